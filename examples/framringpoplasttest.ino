@@ -0,0 +1,58 @@
+/*
+ * Project IoTNode framRing popLast() reboot test
+ * Description: Checks that an element taken by popLast() from a lazily
+ * committed framRing does not come back after a reset
+ * Author: Sentient Things, Inc.
+ */
+
+#include "IoTNode.h"
+
+IoTNode node;
+
+// Sequenced ring - the pointers are saved every 8 pushes and pops
+framRing ring = node.makeFramRing(10, sizeof(uint32_t), 8);
+
+// Test step kept in the RTC SRAM over the reset
+scratchpadT<uint32_t, 0> step(node);
+
+SYSTEM_MODE(MANUAL);
+
+void setup() {
+  Serial1.begin(115200);
+  node.begin();
+  ring.initialize();
+
+  uint32_t stepNow = 0;
+  step.read(stepNow);
+  if (stepNow == 0)
+  {
+    // Push, commit, pop the element and commit again then reset
+    uint32_t value;
+    while (ring.pop((uint8_t*)&value))
+    {
+    }
+    value = 7;
+    ring.push((uint8_t*)&value);
+    node.flush();
+    ring.popLast((uint8_t*)&value);
+    node.flush();
+    step.write(1);
+    Serial1.println("Resetting");
+    delay(100);
+    System.reset();
+  }
+
+  step.write(0);
+  // The first step left the ring empty
+  if (ring.count() == 0)
+  {
+    Serial1.println("PASS: the popped element stayed popped");
+  }
+  else
+  {
+    Serial1.println("FAIL: the popped element came back after the reset");
+  }
+}
+
+void loop() {
+}
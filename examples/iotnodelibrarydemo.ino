@@ -22,6 +22,8 @@ struct Status
 };
 
 Status testStatus;
+// RAM copy of framarraytest
+Status testStatusCache;
 uint32_t unixnow;
 
 // Create FRAM ring of 10 integers
@@ -50,7 +52,18 @@ void setup() {
   DEBUG_PRINTLN();
 
   node.begin();
+  // switchOffFor() saves a boot record so the wake takes the warm start
+  if (node.warmStarted())
+  {
+    DEBUG_PRINTLN("Warm start after switchOffFor()");
+  }
+  else
+  {
+    DEBUG_PRINTLN("Cold start");
+  }
   framringtest.initialize();
+  // Keep framarraytest in RAM - written to FRAM by switchOffFor()
+  framarraytest.enableCache((uint8_t*)&testStatusCache);
 
   if (node.ok())
   {
@@ -119,7 +132,10 @@ void loop() {
   testStatus.lastUnixTime = nodetimenow;
   framarraytest.write(0,(uint8_t*)&testStatus);
 
-  if (node.isLiPoPowered())
+  // Read all of the power states at once
+  PowerStatus power = node.readPowerStatus();
+
+  if (power.liPoPowered)
   {
     DEBUG_PRINTLN("LiPo powered");
   }
@@ -127,7 +143,7 @@ void loop() {
   {
     DEBUG_PRINTLN("Not LiPo powered");
   }
-  if (node.is3AAPowered())
+  if (power.threeAAPowered)
   {
     DEBUG_PRINTLN("3AA powered");
   }
@@ -135,7 +151,7 @@ void loop() {
   {
     DEBUG_PRINTLN("Not 3AA powered");
   }
-  if (node.isLiPoCharged())
+  if (power.liPoCharged)
   {
     DEBUG_PRINTLN("LiPo is fully charged");
   }
@@ -143,7 +159,7 @@ void loop() {
   {
     DEBUG_PRINTLN("LiPo is not fully charged");
   }
-  if (node.isLiPoCharging())
+  if (power.liPoCharging)
   {
     DEBUG_PRINTLN("LiPo is charging");
   }
@@ -153,28 +169,31 @@ void loop() {
   }
 
   DEBUG_PRINT("Node voltage is: ");
-  DEBUG_PRINT(node.voltage());
+  DEBUG_PRINT(power.voltage);
   DEBUG_PRINTLN(" V");
 
   if (!framringtest.isEmpty())
   {
     DEBUG_PRINTLN("Reading the previously written random numbers from FRAM:");
-    for (byte i=0; i<10;++i)
+    // Pop all the elements in one batch
+    int elements[10];
+    uint32_t popped = framringtest.popN((uint8_t*)elements, 10);
+    for (uint32_t i=0; i<popped;++i)
     {
-      int element;
-      bool valid = framringtest.pop((uint8_t*)&element);
-      DEBUG_PRINT(String(element) + " ");
+      DEBUG_PRINT(String(elements[i]) + " ");
     }
     DEBUG_PRINTLN("");
   }
 
   DEBUG_PRINTLN("Writing the following random numbers to FRAM:");
+  int rands[10];
   for (byte i=0; i<10;++i)
   {
-    int rand = random(0,10);
-    framringtest.push((uint8_t*)&rand);
-    DEBUG_PRINT(String(rand) + " ");
+    rands[i] = random(0,10);
+    DEBUG_PRINT(String(rands[i]) + " ");
   }
+  // Push all the elements in one batch
+  framringtest.pushN((uint8_t*)rands, 10);
   DEBUG_PRINTLN("");
 
   node.switchOffFor(10);
@@ -0,0 +1,73 @@
+/*
+ * Project IoTNode partition overlap test
+ * Description: Checks that an unnamed framArray added by a firmware update
+ * cannot reach into a named framArray saved by the earlier firmware
+ * Author: Sentient Things, Inc.
+ */
+
+#include "IoTNode.h"
+
+IoTNode node;
+
+// Test step kept in the RTC SRAM over the reset
+scratchpadT<uint32_t, 0> step(node);
+
+SYSTEM_MODE(MANUAL);
+
+void setup() {
+  Serial1.begin(115200);
+  node.begin();
+
+  // Half of the Fram for the named array so that an unnamed array of the
+  // same size added in front of it must overlap
+  uint32_t numberOfElements = node.framSize() / 2 / 200;
+  framArray big = node.makeFramArray("big", numberOfElements, 200);
+  byte element[200];
+
+  uint32_t stepNow = 0;
+  step.read(stepNow);
+  if (stepNow == 0)
+  {
+    // The earlier firmware saves the named array then resets
+    node.clearPartitions();
+    for (uint32_t i = 0; i < numberOfElements; ++i)
+    {
+      memset(element, i, sizeof(element));
+      big.write(i, element);
+    }
+    step.write(1);
+    Serial1.println("Resetting");
+    delay(100);
+    System.reset();
+  }
+
+  step.write(0);
+  // The update adds an unnamed array of the same size
+  framArray added = node.makeFramArray(numberOfElements, 200);
+  memset(element, 0xEE, sizeof(element));
+  bool written = false;
+  for (uint32_t i = 0; i < numberOfElements; ++i)
+  {
+    written = added.write(i, element) || written;
+  }
+  bool kept = true;
+  for (uint32_t i = 0; i < numberOfElements && kept; ++i)
+  {
+    kept = big.read(i, element);
+    for (uint16_t k = 0; k < sizeof(element) && kept; ++k)
+    {
+      kept = element[k] == (byte)i;
+    }
+  }
+  if (!written && kept)
+  {
+    Serial1.println("PASS: the unnamed array was refused and the named array was kept");
+  }
+  else
+  {
+    Serial1.println("FAIL: the unnamed array overlapped the named array");
+  }
+}
+
+void loop() {
+}
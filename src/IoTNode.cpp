@@ -1,168 +1,486 @@
 #include "IoTNode.h"
 
-Adafruit_MCP23017 expand;
-
 MCP7941x rtc = MCP7941x();
 
-File myFile;
+// The SD card objects are created on first use so that they are not
+// constructed (and are removed by the linker) when backups are not used
+static SdFat& sdVolume()
+{
+  static SdFat sd;
+  return sd;
+}
+
+static File& sdFile()
+{
+  static File file;
+  return file;
+}
 
-SdFat SD;
+// The first FRAM is the on-board MB85RC256V. More parts follow it on the
+// bus up to 0x56.
+#define FRAM_ADDRESS 0x50
+
+// Fujitsu device ID: write the FRAM address to the reserved address
+// then read manufacturer (12 bits), density (4 bits) and product.
+#define FRAM_ID_ADDRESS 0x7C
+#define FRAM_ID_FUJITSU 0x00A
+
+// Time from power on until the parts answer - the FRAM power up time (tPU)
+// with margin
+#define FRAM_POWER_UP_MILLIS 20
+
+// Each I2C address of a FRAM reaches 64 KB. Larger parts take the
+// upper address bits from the I2C address.
+#define FRAM_BANK_SIZE 0x10000UL
+
+// FRAM transfers use as much of the Wire buffer as possible
+// Writes also carry the two address bytes
+#define FRAM_READ_BLOCK_SIZE (iotNodeBoard::i2cBufferSize < 255 ? iotNodeBoard::i2cBufferSize : 255)
+#define FRAM_WRITE_BLOCK_SIZE (iotNodeBoard::i2cBufferSize - 2)
+
+// FRAM backups are written to the uSD card in whole sectors
+#define SD_SECTOR_SIZE 512
+
+// IoT Node system area at the bottom of FRAM - see IOTNODE_FRAM_SYSTEM_SIZE
+// Dirty map block size (uint16_t) and the map of changed blocks
+#define FRAM_DIRTY_BLOCK_SIZE_OFFSET 0
+#define FRAM_DIRTY_MAP_OFFSET 2
+// Boot record for a warm start after the dirty map
+#define FRAM_BOOT_RECORD_OFFSET (FRAM_DIRTY_MAP_OFFSET + FRAM_DIRTY_MAP_SIZE)
+#define FRAM_BOOT_MAGIC 0x42544F49 // "IOTB"
+
+// framRing pointers saved by this library - "Rg"
+#define FRAM_RING_MAGIC 0x6752
+
+// Sequenced framRing slots are moved through a staging buffer
+#define FRAM_RING_STAGE_SIZE 128
+// Longest zigzag varint of an int32_t
+#define FRAM_PACKED_VARINT_SIZE 5
+// The record count of a framPackedRing block saved before it was full
+#define FRAM_PACKED_OPEN 0x80
+
+// Marks each batch of changed blocks in a backupFRAMChangesToSD() file
+#define FRAM_CHANGES_MAGIC 0x44544F49 // "IOTD"
+
+// Partition directory
+#define FRAM_DIRECTORY_MAGIC 0x32544F49 // "IOT2" - entries with their reserved size
+#define FRAM_DIRECTORY_ENTRIES ((IOTNODE_FRAM_DIRECTORY_SIZE - sizeof(framDirectoryHeader)) / sizeof(framDirectoryEntry))
+// Entries read at a time while searching the directory
+#define FRAM_DIRECTORY_SCAN_ENTRIES 4
+#define FRAM_PARTITION_ARRAY 1
+#define FRAM_PARTITION_RING 2
+
+// backupFRAMSnapshotToSD() file format
+#define FRAM_SNAPSHOT_MAGIC 0x53544F49 // "IOTS"
+#define FRAM_SNAPSHOT_VERSION 1
+#define FRAM_SNAPSHOT_BLOCK_SIZE 64
+// Record types - a run of blocks filled with one value or one block of data
+#define FRAM_SNAPSHOT_FILL 0
+#define FRAM_SNAPSHOT_RAW 1
+
+// MCP23018 expander address and registers (IOCON.BANK = 0)
+// Counts the I2C transactions of the enclosing function against an API
+#ifdef IOTNODE_I2C_TRACE
+  #define TRACE_FLAG_READ (1 << 0)
+  #define TRACE_FLAG_ACK (1 << 1)
+  // A whole MCP7941x library call - its bytes and result are not known
+  #define TRACE_FLAG_CALL (1 << 2)
+  #define TRACE_API(node, api) IoTNode::traceScope traceScope(node, IoTNode::api)
+#else
+  #define TRACE_API(node, api)
+#endif
+
+// Times an MCP7941x library call, which does not use the Wire wrappers,
+// as one transaction of the device
+#define RTC_CALL(address, call) do { uint32_t callStart = micros(); call; recordCall(address, callStart); } while (0)
+
+// On-board I2C devices in i2cDeviceStats order
+// RTC MCP79412, Expander MCP23018, RTC EEPROM, ADC MCP3221, FRAM MB85RC256V
+static const byte i2cAddresses[IOTNODE_I2C_DEVICES] = {0x6F, 0x20, 0x57, 0x4D, 0x50};
+
+// MCP79412 RTC registers
+#define RTC_ADDRESS 0x6F
+#define RTC_EEPROM_ADDRESS 0x57
+#define RTC_ALM0WKDAY 0x0D
+#define RTC_ALM0IF_BIT (1 << 3)
+#define RTC_SRAM 0x20
+#define RTC_SRAM_SIZE 64
+// SRAM layout marker then two scratchpad copies - generation, bytes and CRC
+#define RTC_SCRATCHPAD_MAGIC 0x5053
+#define RTC_SCRATCHPAD_COPY (IOTNODE_SCRATCHPAD_SIZE + 3)
+static_assert(sizeof(uint16_t) + 2 * RTC_SCRATCHPAD_COPY <= RTC_SRAM_SIZE, "IOTNODE_SCRATCHPAD_SIZE does not fit the MCP79412 SRAM");
+// Bytes that fit the Wire buffer with the register address
+#define RTC_WRITE_BLOCK_SIZE (iotNodeBoard::i2cBufferSize - 1)
+
+#define ADC_ADDRESS 0x4D
+// Input voltage at the full 4096 code scale: 3.3*(4.7+1.5)/1.5
+#define ADC_FULL_SCALE_VOLTS 13.64
+#define ADC_FULL_SCALE_MILLIVOLTS 13640
+// Whole conversions (2 bytes each) that fit a Wire read
+#define ADC_READ_BLOCK_SIZE (FRAM_READ_BLOCK_SIZE & ~1)
+// Sums of 2^8 12 bit conversions fit in 20 bits
+#define ADC_MAX_OVERSAMPLE_BITS 8
+
+#define EXPANDER_ADDRESS 0x20
+#define EXPANDER_IODIRA 0x00
+#define EXPANDER_GPPUA 0x0C
+#define EXPANDER_GPIOA 0x12
+#define EXPANDER_GPIOB 0x13
+#define EXPANDER_OLATA 0x14
+// Watchdog DONE pulse on GPA5
+#define EXPANDER_WATCHDOG_BIT (1 << 5)
+// IODIRA to GPPUB
+#define EXPANDER_CONFIG_SIZE 14
+
+// Pin direction 1 = in, 0 = out
+// PORT_A 0b01000000 | PORT_B 0b11111111
+#define EXPANDER_IODIR 0xFF40
+// Pull ups on all pins
+#define EXPANDER_GPPU 0xFFFF
+
+// GPIOB status bits - CN3065 DONE (pin 8), CN3065 CHRG (pin 9)
+// and TPS2113 STAT (pin 10)
+#define STATUS_DONE_BIT (1 << 0)
+#define STATUS_CHRG_BIT (1 << 1)
+#define STATUS_PWR_BIT (1 << 2)
 
-// Create FRAM instances
-#define PART_NUMBER MB85RC256V
 
 
 
 
 // Constructor
-IoTNode::IoTNode() : myFram(PART_NUMBER)
+IoTNode::IoTNode() : _framNextAddress(0)
 {
+  // The on-board part until begin() finds the Fram
+  _framChips[0].address = FRAM_ADDRESS;
+  _framChips[0].size = IOTNODE_FRAM_SIZE;
+  _framChipCount = 1;
+  _framSize = IOTNODE_FRAM_SIZE;
+  _partitionsAddress = directoryAddress();
+  // Reserve the system area before any framArray or framRing
+  framResult result;
+  _systemAddress = allocateFRAM(IOTNODE_FRAM_SYSTEM_SIZE, result);
+  memset(_dirtyMap, 0xFF, sizeof(_dirtyMap));
 
 }
 
 void IoTNode::resetWire(){
+  clearBus();
+  #ifndef PARTICLE
+    delay(50);
+  #endif
+}
+
+// Frees a device holding SDA low and restarts Wire
+void IoTNode::clearBus()
+{
   #ifdef PARTICLE
     Wire.reset();
   #else
-    pinMode(D0, INPUT_PULLUP); //Turn SCA into high impedance input
-    pinMode(D1, OUTPUT); //Turn SCL into a normal GPO 
-    digitalWrite(D1, HIGH); // Start idle HIGH
+    pinMode(iotNodeBoard::sda, INPUT_PULLUP); //Turn SCA into high impedance input
+    pinMode(iotNodeBoard::scl, OUTPUT); //Turn SCL into a normal GPO 
+    digitalWrite(iotNodeBoard::scl, HIGH); // Start idle HIGH
 
     //Generate 9 pulses on SCL to tell slave to release the bus
     for(int i=0; i <9; i++)
     {
-      digitalWrite(D1, LOW);
+      digitalWrite(iotNodeBoard::scl, LOW);
       delayMicroseconds(100);
-      digitalWrite(D1, HIGH);
+      digitalWrite(iotNodeBoard::scl, HIGH);
       delayMicroseconds(100);
     }
 
     //Change SCL to be an input
-    pinMode(D1, INPUT_PULLUP);
+    pinMode(iotNodeBoard::scl, INPUT_PULLUP);
 
     //Start i2c over again
     Wire.begin(); 
-    delay(50);
   #endif
 }
 
-bool IoTNode::begin()
+bool IoTNode::probeI2C(byte address)
+{
+  int device = i2cDevice(address);
+  Wire.beginTransmission(address);
+  if (endTransmission(address, 0) == 0)
+  {
+    if (device >= 0)
+    {
+      _i2cHealth[device].backoffMillis = 0;
+    }
+    return true;
+  }
+
+  // Fail fast while a device that failed recovery backs off
+  uint32_t now = millis();
+  if (device >= 0 && _i2cHealth[device].backoffMillis > 0 &&
+      now - _i2cHealth[device].failedMillis < _i2cHealth[device].backoffMillis)
+  {
+    return false;
+  }
+
+  // Recover and retry with a doubling wait within the time budget
+  uint32_t wait = 1;
+  bool answered = false;
+  while (!answered && millis() - now < IOTNODE_I2C_RECOVERY_MILLIS)
+  {
+    if (device >= 0)
+    {
+      _i2cHealth[device].recoveries++;
+    }
+    clearBus();
+    Wire.beginTransmission(address);
+    answered = endTransmission(address, 0) == 0;
+    uint32_t elapsed = millis() - now;
+    if (!answered && elapsed < IOTNODE_I2C_RECOVERY_MILLIS)
+    {
+      uint32_t left = IOTNODE_I2C_RECOVERY_MILLIS - elapsed;
+      delay(wait < left ? wait : left);
+      wait *= 2;
+    }
+  }
+
+  if (device >= 0)
+  {
+    i2cDeviceHealth& health = _i2cHealth[device];
+    if (answered)
+    {
+      health.backoffMillis = 0;
+    }
+    else
+    {
+      health.backoffMillis = health.backoffMillis == 0 ? IOTNODE_I2C_RECOVERY_MILLIS :
+        (health.backoffMillis < 0x80000000UL ? health.backoffMillis * 2 : health.backoffMillis);
+      health.failedMillis = millis();
+    }
+  }
+  return answered;
+}
+
+i2cDeviceStats IoTNode::i2cStats(byte address)
+{
+  i2cDeviceStats stats = {0, 0, 0, 0, 0, 0};
+  int device = i2cDevice(address);
+  if (device >= 0 && _i2cHealth[device].transactions > 0)
+  {
+    i2cDeviceHealth& health = _i2cHealth[device];
+    stats.transactions = health.transactions;
+    stats.nacks = health.nacks;
+    stats.recoveries = health.recoveries;
+    stats.minMicros = health.minMicros;
+    stats.averageMicros = health.totalMicros / health.transactions;
+    stats.maxMicros = health.maxMicros;
+  }
+  return stats;
+}
+
+void IoTNode::clearI2CStats()
+{
+  memset(_i2cHealth, 0, sizeof(_i2cHealth));
+}
+
+bool IoTNode::begin(bool warmStart)
 {
+  TRACE_API(*this, TRACE_BEGIN);
   Wire.begin();
 
-  delay(20);
-  byte error, address;
   bool result = true;
+  _warmStarted = warmStart && warmBegin();
+  if (!_warmStarted)
+  {
+    result = coldBegin();
+  }
 
-  // The i2c_scanner uses the return value of
-  // the Write.endTransmisstion to see if
-  // a device did acknowledge to the address.
-  address = 0x20; // MCP23017 address
-  Wire.beginTransmission(address);
-  error = Wire.endTransmission();
+  loadScratchpad();
+
+  // Load the shadow registers
+  _iodir = EXPANDER_IODIR;
+  _gppu = EXPANDER_GPPU;
+  readExpander(EXPANDER_OLATA, _olat);
+  _olat &= ~EXPANDER_WATCHDOG_BIT;
+  _olatWritten = _olat;
+  _outputsChanged = false;
+
+  // Node ID from MCP79412 EUI-64 node address
+  char nodeHexStr[17] = "";
+  array_to_string(_eui64, 8, nodeHexStr);
+  nodeID = String(nodeHexStr);
+  return result;
+}
+
+bool IoTNode::warmStarted()
+{
+  return _warmStarted;
+}
+
+uint32_t IoTNode::framSize()
+{
+  return _framSize;
+}
+
+uint8_t IoTNode::framChips()
+{
+  return _framChipCount;
+}
+
+// The full start after power on
+bool IoTNode::coldBegin()
+{
+  delay(FRAM_POWER_UP_MILLIS);
+  bool result = true;
+
+  // Before the dirty map as its block size depends on the Fram size
+  detectFRAM();
 
-  // Try again if there is an error
-  if (!error==0)
+  // Return false if the MCP23018 does not answer
+  if (!probeI2C(EXPANDER_ADDRESS))
   {
-    resetWire();
-    Wire.beginTransmission(address);
-    error = Wire.endTransmission();
+    result = false;
   }
 
-  // Return false if there is an error
-  if (!error == 0)
+  // Read IODIRA through GPPUB in one transaction and only write
+  // the configuration when it does not match - e.g. after a power cycle
+  byte config[EXPANDER_CONFIG_SIZE];
+  if (readExpander(EXPANDER_IODIRA, config, EXPANDER_CONFIG_SIZE))
+  {
+    if (config[EXPANDER_IODIRA] != (EXPANDER_IODIR & 0xFF) ||
+        config[EXPANDER_IODIRA + 1] != (EXPANDER_IODIR >> 8) ||
+        config[EXPANDER_GPPUA] != (EXPANDER_GPPU & 0xFF) ||
+        config[EXPANDER_GPPUA + 1] != (EXPANDER_GPPU >> 8))
+    {
+      config[EXPANDER_IODIRA] = EXPANDER_IODIR & 0xFF;
+      config[EXPANDER_IODIRA + 1] = EXPANDER_IODIR >> 8;
+      config[EXPANDER_GPPUA] = EXPANDER_GPPU & 0xFF;
+      config[EXPANDER_GPPUA + 1] = EXPANDER_GPPU >> 8;
+      // The registers in between are written back unchanged
+      writeExpander(EXPANDER_IODIRA, config, EXPANDER_CONFIG_SIZE);
+    }
+  }
+  else
   {
     result = false;
   }
-  
-
-  expand.begin();
-  //Set pin direction 1 = out, 0 = in
-  //PORT_A,0b10111111 | PORT_B,0b00001111
-  expand.pinMode(0,OUTPUT);
-  expand.pinMode(1,OUTPUT);
-  expand.pinMode(2,OUTPUT);
-  expand.pinMode(3,OUTPUT);
-  expand.pinMode(4,OUTPUT);
-  expand.pinMode(5,OUTPUT);
-  expand.pinMode(6,INPUT);
-  expand.pinMode(7,OUTPUT);
-  expand.pinMode(8,INPUT);
-  expand.pinMode(9,INPUT);
-  expand.pinMode(10,INPUT);
-  expand.pinMode(11,INPUT);
-  expand.pinMode(12,INPUT);
-  expand.pinMode(13,INPUT);
-  expand.pinMode(14,INPUT);
-  expand.pinMode(15,INPUT);
-
-  expand.pullUp(0,HIGH);
-  expand.pullUp(1,HIGH);
-  expand.pullUp(2,HIGH);
-  expand.pullUp(3,HIGH);
-  expand.pullUp(4,HIGH);
-  expand.pullUp(5,HIGH);
-  expand.pullUp(6,HIGH);
-  expand.pullUp(7,HIGH);
-  expand.pullUp(8,HIGH);
-  expand.pullUp(9,HIGH);
-  expand.pullUp(10,HIGH);
-  expand.pullUp(11,HIGH); 
-  expand.pullUp(12,HIGH);
-  expand.pullUp(13,HIGH);
-  expand.pullUp(14,HIGH);
-  expand.pullUp(15,HIGH);
+
+  loadDirtyMap();
 
   // Get node ID from MCP79412 EUI-64 node address
-  byte nodeHex[8] = "";
-  char nodeHexStr[17] = "";
-  rtc.getMacAddress(nodeHex);
-  array_to_string(nodeHex, 8, nodeHexStr);
-  nodeID = String(nodeHexStr);
+  RTC_CALL(RTC_EEPROM_ADDRESS, rtc.getMacAddress(_eui64));
   return result;
+}
+
+// Starts from the boot record after an alarm wake. Skips the power on
+// delay once the MCU has been running for it, the expander probe and read,
+// and the EEPROM read of the node ID.
+// Returns false to take the cold start.
+bool IoTNode::warmBegin()
+{
+  // The alarm flag stays set - clearing it switches the power off
+  byte alarm = 0;
+  if (!readRTC(RTC_ALM0WKDAY, &alarm, 1) || (alarm & RTC_ALM0IF_BIT) == 0)
+  {
+    return false;
+  }
+
+  // The alarm switched the power on for the Fram and the MCU together, so
+  // the Fram is ready unless the MCU started within its power up time
+  uint32_t upMillis = millis();
+  if (upMillis < FRAM_POWER_UP_MILLIS)
+  {
+    delay(FRAM_POWER_UP_MILLIS - upMillis);
+  }
+
+  // The dirty map and the boot record in one read
+  byte system[FRAM_BOOT_RECORD_OFFSET + sizeof(framBootRecord)];
+  if (!readFRAM(_systemAddress, sizeof(system), system))
+  {
+    return false;
+  }
+  uint16_t blockSize;
+  framBootRecord record;
+  memcpy(&blockSize, system + FRAM_DIRTY_BLOCK_SIZE_OFFSET, sizeof(blockSize));
+  memcpy(&record, system + FRAM_BOOT_RECORD_OFFSET, sizeof(record));
+  uint16_t crc = record.crc;
+  record.crc = 0;
+  if (record.magic != FRAM_BOOT_MAGIC || record.expanderHash != expanderHash() ||
+      crc != crc16((uint8_t*)&record, sizeof(record), 0xFFFF))
+  {
+    return false;
+  }
 
+  // The Fram parts found by the cold start
+  framChip chips[IOTNODE_FRAM_CHIPS];
+  uint8_t count = 0;
+  while (count < IOTNODE_FRAM_CHIPS && record.framSizeBits[count] != 0)
+  {
+    chips[count].address = record.framAddresses[count];
+    chips[count].size = 1UL << record.framSizeBits[count];
+    ++count;
+  }
+  useFRAM(chips, count);
+  if (blockSize != _backupBlockSize)
+  {
+    return false;
+  }
+
+  // Write the configuration without reading it - the writes also
+  // check that the expander answers
+  if (!writeExpander(EXPANDER_IODIRA, (uint16_t)EXPANDER_IODIR) ||
+      !writeExpander(EXPANDER_GPPUA, (uint16_t)EXPANDER_GPPU))
+  {
+    return false;
+  }
+
+  memcpy(_dirtyMap, system + FRAM_DIRTY_MAP_OFFSET, FRAM_DIRTY_MAP_SIZE);
+  memcpy(_eui64, record.eui64, sizeof(_eui64));
+  return true;
+}
+
+// Saves the node ID for the warm start after the next alarm wake
+void IoTNode::writeBootRecord()
+{
+  framBootRecord record;
+  record.magic = FRAM_BOOT_MAGIC;
+  memcpy(record.eui64, _eui64, sizeof(record.eui64));
+  record.expanderHash = expanderHash();
+  memset(record.framAddresses, 0, sizeof(record.framAddresses));
+  memset(record.framSizeBits, 0, sizeof(record.framSizeBits));
+  for (uint8_t i = 0; i < _framChipCount; ++i)
+  {
+    record.framAddresses[i] = _framChips[i].address;
+    while ((1UL << record.framSizeBits[i]) < _framChips[i].size)
+    {
+      ++record.framSizeBits[i];
+    }
+  }
+  record.crc = 0;
+  record.crc = crc16((uint8_t*)&record, sizeof(record), 0xFFFF);
+  writeFRAMUntracked(_systemAddress + FRAM_BOOT_RECORD_OFFSET, sizeof(record), (uint8_t*)&record);
+}
+
+// A boot record from a library with a different expander configuration
+// takes the cold start
+uint16_t IoTNode::expanderHash()
+{
+  uint16_t config[] = {EXPANDER_IODIR, EXPANDER_GPPU};
+  return crc16((uint8_t*)config, sizeof(config), 0xFFFF);
 }
 
 // check i2c devices with i2c names at i2c address of length i2c length returned in i2cExists
 bool IoTNode::ok()
 {
+  TRACE_API(*this, TRACE_OK);
   // "RTC MCP79412",
   // "Expander MCP23018",
   // "RTC EEPROM",
   // "ADC MCP3221",
   // "FRAM M85RC256V",
-  byte i2cAd[]=
-  {
-      0x6F, //111
-      0x20, //32
-      0x57, //87
-      0x4D, //77
-      0x50 //80
-  };
-
   Wire.begin();
 
-  byte error, address;
   bool result = true;
-  for (int i=0; i<5; ++i)
+  for (int i=0; i<IOTNODE_I2C_DEVICES; ++i)
   {
-    // The i2c_scanner uses the return value of
-    // the Write.endTransmisstion to see if
-    // a device did acknowledge to the address.
-    address = i2cAd[i];
-    Wire.beginTransmission(address);
-    error = Wire.endTransmission();
-
-    // Try again if there is an error
-    if (!error==0)
-    {
-      resetWire();
-      Wire.beginTransmission(address);
-      error = Wire.endTransmission();
-    }
- 
     // Return false if there is an error
-    if (!error == 0)
+    if (!probeI2C(i2cAddresses[i]))
     {
       result = false;
       break;
@@ -182,8 +500,11 @@ bool IoTNode::ok()
 // for EXT3V3 and EXT5V
 void IoTNode::setPowerON(powerName pwrName, bool state)
 {
-  expand.digitalWrite(pwrName, state);
-  //i.e. expand.digitalWrite(3, state);
+  if (!(iotNodeBoard::rails & (1 << pwrName)))
+  {
+    return;
+  }
+  setOutput(pwrName, state);
 }
 
 // Uses the MCP23018 expander to enable or disable the specified power regulator
@@ -194,7 +515,11 @@ void IoTNode::setPowerON(powerName pwrName, bool state)
 // for EXT3V3 and EXT5V
 void IoTNode::setPower(powerName pwrName, bool state)
 {
-  expand.digitalWrite(pwrName, state);
+  if (!(iotNodeBoard::rails & (1 << pwrName)))
+  {
+    return;
+  }
+  setOutput(pwrName, state);
 }
 
 // Uses the MCP23018 expander to enable high the specified power regulator
@@ -205,7 +530,11 @@ void IoTNode::setPower(powerName pwrName, bool state)
 // for EXT3V3 and EXT5V
 void IoTNode::powerON(powerName pwrName)
 {
-  expand.digitalWrite(pwrName, true);
+  if (!(iotNodeBoard::rails & (1 << pwrName)))
+  {
+    return;
+  }
+  setOutput(pwrName, true);
 }
 
 // Uses the MCP23018 expander to enable low the specified power regulator
@@ -214,7 +543,11 @@ void IoTNode::powerON(powerName pwrName)
 // for EXT3V3 and EXT5V
 void IoTNode::powerOFF(powerName pwrName)
 {
-  expand.digitalWrite(pwrName, false);
+  if (!(iotNodeBoard::rails & (1 << pwrName)))
+  {
+    return;
+  }
+  setOutput(pwrName, false);
 }
 
 // Uses the MCP23018 expander to enable high all the power regulator enable pins
@@ -224,11 +557,13 @@ void IoTNode::powerOFF(powerName pwrName)
 void IoTNode::allPowerON()
 {
   // INT5V, INT12V, EXT3V3, EXT5V, EXT12V
-  expand.digitalWrite(EXT3V3, true);
-  expand.digitalWrite(EXT5V, true);
-  expand.digitalWrite(EXT12V, true);
-  expand.digitalWrite(INT5V, true);
-  expand.digitalWrite(INT12V, true);
+  // Set in the shadow register and write once
+  _olat |= iotNodeBoard::rails;
+  _outputsChanged = true;
+  if (!_holdOutputs)
+  {
+    applyOutputs();
+  }
 }
 
 // Uses the MCP23018 expander to enable low all the power regulator enable pins
@@ -238,39 +573,122 @@ void IoTNode::allPowerON()
 void IoTNode::allPowerOFF()
 {
   // INT5V, INT12V, EXT3V3, EXT5V, EXT12V
-  expand.digitalWrite(EXT3V3, false);
-  expand.digitalWrite(EXT5V, false);
-  expand.digitalWrite(EXT12V, false);
-  expand.digitalWrite(INT5V, false);
-  expand.digitalWrite(INT12V, false);
+  // Set in the shadow register and write once
+  _olat &= ~iotNodeBoard::rails;
+  _outputsChanged = true;
+  if (!_holdOutputs)
+  {
+    applyOutputs();
+  }
+}
+
+// Finishes the background requests then writes back every cached
+// framArray, saves the open blocks of every framPackedRing and commits
+// every framRing with a commit interval
+void IoTNode::flush()
+{
+  TRACE_API(*this, TRACE_FLUSH);
+  while (poll())
+  {
+  }
+  for (framArray *array = _cachedArrays; array != NULL; array = array->_nextCached)
+  {
+    array->flush();
+  }
+  for (framPackedRing *ring = _packedRings; ring != NULL; ring = ring->_nextPacked)
+  {
+    ring->flush();
+  }
+  for (framRing *ring = _lazyRings; ring != NULL; ring = ring->_nextLazy)
+  {
+    ring->commit();
+  }
+}
+
+// Runs one step of the oldest request. A watchdog pulse that has
+// started waits without holding up the requests behind it.
+bool IoTNode::poll()
+{
+  TRACE_API(*this, TRACE_POLL);
+  int next = -1;
+  for (int i = 0; i < IOTNODE_REQUEST_QUEUE_SIZE; ++i)
+  {
+    nodeRequest& request = _requests[i];
+    if (request.status != REQUEST_PENDING)
+    {
+      continue;
+    }
+    if (request.type == REQUEST_WATCHDOG && request.started)
+    {
+      if (millis() - request.startMillis < 50)
+      {
+        continue;
+      }
+      // The pulse is due to end
+      next = i;
+      break;
+    }
+    if (next < 0 || (int32_t)(request.order - _requests[next].order) < 0)
+    {
+      next = i;
+    }
+  }
+  if (next >= 0)
+  {
+    nodeRequest& request = _requests[next];
+    if (!runRequest(request))
+    {
+      finishRequest(next, false);
+    }
+    else if (request.remaining == 0)
+    {
+      finishRequest(next, true);
+    }
+  }
+  for (int i = 0; i < IOTNODE_REQUEST_QUEUE_SIZE; ++i)
+  {
+    if (_requests[i].status == REQUEST_PENDING)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+requestStatus IoTNode::requestState(int handle)
+{
+  if (handle < 0 || handle >= IOTNODE_REQUEST_QUEUE_SIZE)
+  {
+    return REQUEST_NONE;
+  }
+  requestStatus status = _requests[handle].status;
+  if (status == REQUEST_DONE || status == REQUEST_FAILED)
+  {
+    _requests[handle].status = REQUEST_NONE;
+  }
+  return status;
+}
+
+int IoTNode::requestWatchdog(requestCallback callback, void *context)
+{
+  return addRequest(REQUEST_WATCHDOG, 0, 1, NULL, callback, context);
+}
+
+int IoTNode::requestOutputs(requestCallback callback, void *context)
+{
+  return addRequest(REQUEST_OUTPUTS, 0, 1, NULL, callback, context);
+}
+
+int IoTNode::requestVoltage(float *voltage, requestCallback callback, void *context)
+{
+  return addRequest(REQUEST_VOLTAGE, 0, 1, (uint8_t*)voltage, callback, context);
 }
 
 // Powers off the IoT Node board using the RTC
 // RTC CONTROL switch must be set to Yes
 void IoTNode::switchOffFor(long seconds, maskValue mask)
 {
-  // Set the RTC high so that the power stays on until the alarm is enabled
-  rtc.outHigh();
-  // Disable both alarms
-  rtc.disableAlarms();
-  // Set the timer mask
-  rtc.maskAlarm0(mask);
-  // Set the alarm polarization high - i.e. when alarm sets switch back on
-  rtc.setAlarm0PolHigh();
-  rtc.clearIntAlarm0();
-  // Load the alarm match value (all registers)      
-  int rtcnow = rtc.rtcNow();
-  int alarmTime = rtcnow + seconds;
-  rtc.setAlarm0UnixTime(alarmTime);
-  // Enable the alarm. This will set the MFP output low
-  // turning off the power until the alarm triggers
-  // turning on the power again and starting the code from
-  // the beginning.
-  rtc.enableClock();
-  // Ensure the ALMxIF flag is cleared
-  rtc.enableAlarm0();
-  Wire.end();
-  delay(200);  
+  switchOff(seconds, mask, false);
 }
 
 // Powers off the IoT Node board using the MCP49412 real time clock MFP output
@@ -278,39 +696,57 @@ void IoTNode::switchOffFor(long seconds, maskValue mask)
 // RTC CONTROL switch must be set to Yes
 void IoTNode::switchOffFor(long seconds)
 {
-  int rtcnow = rtc.rtcNow();
-  int alarmTime = rtcnow + seconds; 
-  rtc.disableClock();
+  switchOff(seconds, ALL, true);
+}
+
+// Both switchOffFor() save the cached Fram data and the boot record
+// for the warm start
+void IoTNode::switchOff(long seconds, maskValue mask, bool stopClock)
+{
+  TRACE_API(*this, TRACE_SLEEP);
+  flush();
+  writeBootRecord();
+  int rtcnow;
+  RTC_CALL(RTC_ADDRESS, rtcnow = rtc.rtcNow());
+  int alarmTime = rtcnow + seconds;
+  if (stopClock)
+  {
+    RTC_CALL(RTC_ADDRESS, rtc.disableClock());
+  }
   // Set the RTC high so that the power stays on until the alarm is enabled
-  rtc.outHigh();
+  RTC_CALL(RTC_ADDRESS, rtc.outHigh());
   // Disable both alarms
-  rtc.disableAlarms();
+  RTC_CALL(RTC_ADDRESS, rtc.disableAlarms());
   // Set the timer mask
-  rtc.maskAlarm0(ALL);
+  RTC_CALL(RTC_ADDRESS, rtc.maskAlarm0(mask));
   // Set the alarm polarization high - i.e. when alarm sets switch back on
-  rtc.setAlarm0PolHigh();
-  rtc.clearIntAlarm0();
+  RTC_CALL(RTC_ADDRESS, rtc.setAlarm0PolHigh());
+  RTC_CALL(RTC_ADDRESS, rtc.clearIntAlarm0());
   // Load the alarm match value (all registers)      
-  rtc.setAlarm0UnixTime(alarmTime);
+  RTC_CALL(RTC_ADDRESS, rtc.setAlarm0UnixTime(alarmTime));
   // Enable the alarm. This will set the MFP output low
   // turning off the power until the alarm triggers
   // turning on the power again and starting the code from
   // the beginning.
-  rtc.enableClock();
+  RTC_CALL(RTC_ADDRESS, rtc.enableClock());
   // Ensure the ALMxIF flag is cleared
-  rtc.enableAlarm0();
+  RTC_CALL(RTC_ADDRESS, rtc.enableAlarm0());
+  if (!stopClock)
+  {
+    Wire.end();
+  }
   delay(200);  
 }
 
 void IoTNode::resetRTCSwitch()
 {
-  rtc.disableClock();
+  RTC_CALL(RTC_ADDRESS, rtc.disableClock());
   // Set the RTC high so that the power stays on until the alarm is enabled
-  rtc.outHigh();
+  RTC_CALL(RTC_ADDRESS, rtc.outHigh());
   // Disable both alarms
-  rtc.disableAlarms();
+  RTC_CALL(RTC_ADDRESS, rtc.disableAlarms());
   // Set the timer mask
-  rtc.enableClock();
+  RTC_CALL(RTC_ADDRESS, rtc.enableClock());
 }
 
 
@@ -321,7 +757,12 @@ void IoTNode::resetRTCSwitch()
 // GIO3 is the GPIO pin (labled IO) on the RJ45 I/O-3 connector
 void IoTNode::setPullUp(gioName ioName, bool state)
     {
-        expand.pullUp(ioName, (uint8_t)state);
+        uint16_t gppu = state ? (_gppu | (1 << ioName)) : (_gppu & ~(1 << ioName));
+        if (gppu != _gppu)
+        {
+          _gppu = gppu;
+          writeExpander(EXPANDER_GPPUA, _gppu);
+        }
     }
 
 // Enables or disables the GPIO pin on the RJ45 connectors
@@ -331,8 +772,9 @@ void IoTNode::setPullUp(gioName ioName, bool state)
 // GIO3 is the GPIO pin (labled IO) on the RJ45 I/O-3 connector
 void IoTNode::setGIO(gioName ioName, bool state)
 {
-  expand.pinMode(ioName,OUTPUT);
-  expand.digitalWrite(ioName, state);
+  // Latch the level before switching to output
+  setOutput(ioName, state);
+  setDirection(ioName, OUTPUT);
 }
 
 // Reads the GPIO pin on the RJ45 connectors
@@ -342,8 +784,11 @@ void IoTNode::setGIO(gioName ioName, bool state)
 // GIO3 is the GPIO pin (labled IO) on the RJ45 I/O-3 connector
 bool IoTNode::getGIO(gioName ioName)
 {
-  expand.pinMode(ioName,INPUT);
-  if(expand.digitalRead(ioName)==0)
+  TRACE_API(*this, TRACE_INPUTS);
+  setDirection(ioName, INPUT);
+  uint16_t gpio = 0xFFFF;
+  readExpander(EXPANDER_GPIOA, gpio);
+  if((gpio & (1 << ioName))==0)
   {
     return true;
   }
@@ -361,16 +806,21 @@ bool IoTNode::getGIO(gioName ioName)
 // using the dip switch on the IoT Node board
 void IoTNode::tickleWatchdog()
 {
-  expand.digitalWrite(5,true);
+  TRACE_API(*this, TRACE_WATCHDOG);
+  // Pulse is always written even when outputs are held - on top of the
+  // outputs last written so held changes are not applied
+  writeOutputs(_olatWritten | EXPANDER_WATCHDOG_BIT);
   //delayMicroseconds(100);
   delay(50);
-  expand.digitalWrite(5,false);
+  writeOutputs(_olatWritten & ~EXPANDER_WATCHDOG_BIT);
 }
 
 bool IoTNode::isLiPoPowered()
 {
-// uint8_t digitalRead(uint8_t p);
-  if(expand.digitalRead(10)==0)
+  TRACE_API(*this, TRACE_INPUTS);
+  byte status = 0xFF;
+  readExpander(EXPANDER_GPIOB, &status, 1);
+  if((status & STATUS_PWR_BIT)==0)
   {
     return true;
   }
@@ -382,8 +832,10 @@ bool IoTNode::isLiPoPowered()
 
 bool IoTNode::is3AAPowered()
 {
-// uint8_t digitalRead(uint8_t p);
-  if(expand.digitalRead(10)==1)
+  TRACE_API(*this, TRACE_INPUTS);
+  byte status = 0xFF;
+  readExpander(EXPANDER_GPIOB, &status, 1);
+  if((status & STATUS_PWR_BIT)!=0)
   {
     return true;
   }
@@ -395,8 +847,10 @@ bool IoTNode::is3AAPowered()
 
 bool IoTNode::isLiPoCharged()
 {
-// uint8_t digitalRead(uint8_t p);
-  if(expand.digitalRead(8)==0)
+  TRACE_API(*this, TRACE_INPUTS);
+  byte status = 0xFF;
+  readExpander(EXPANDER_GPIOB, &status, 1);
+  if((status & STATUS_DONE_BIT)==0)
   {
     return true;
   }
@@ -408,8 +862,10 @@ bool IoTNode::isLiPoCharged()
 
 bool IoTNode::isLiPoCharging()
 {
-// uint8_t digitalRead(uint8_t p);
-  if(expand.digitalRead(9)==0)
+  TRACE_API(*this, TRACE_INPUTS);
+  byte status = 0xFF;
+  readExpander(EXPANDER_GPIOB, &status, 1);
+  if((status & STATUS_CHRG_BIT)==0)
   {
     return true;
   }
@@ -419,293 +875,3024 @@ bool IoTNode::isLiPoCharging()
   }
 }
 
+// Reads the TPS2113 and CN3065 status pins with one GPIOB read
+// and the input voltage
+PowerStatus IoTNode::readPowerStatus()
+{
+  TRACE_API(*this, TRACE_INPUTS);
+  PowerStatus powerStatus;
+  byte status = 0xFF;
+  readExpander(EXPANDER_GPIOB, &status, 1);
+  powerStatus.voltage = voltage();
+  powerStatus.liPoPowered = (status & STATUS_PWR_BIT) == 0;
+  powerStatus.threeAAPowered = (status & STATUS_PWR_BIT) != 0;
+  powerStatus.liPoCharged = (status & STATUS_DONE_BIT) == 0;
+  powerStatus.liPoCharging = (status & STATUS_CHRG_BIT) == 0;
+  return powerStatus;
+}
+
 float IoTNode::voltage()
 {
-    unsigned int rawVoltage = 0;
+    TRACE_API(*this, TRACE_VOLTAGE);
+    uint16_t rawVoltage = 0;
     float voltage = 0.0;
-    Wire.requestFrom(0x4D, 2);
-    if (Wire.available() == 2)
+    if (readADC(rawVoltage))
     {
-      rawVoltage = (Wire.read() << 8) | (Wire.read());
-      voltage = (float)(rawVoltage)/4096.0*13.64; // 3.3*(4.7+1.5)/1.5
+      voltage = (float)(rawVoltage)/4096.0*ADC_FULL_SCALE_VOLTS;
     }
     return voltage;
 }
 
-
-uint32_t IoTNode::unixTime()
+bool IoTNode::readVoltage(uint16_t& millivolts)
 {
-  return rtc.rtcNow();
+  TRACE_API(*this, TRACE_VOLTAGE);
+  uint16_t code;
+  if (!readADC(code))
+  {
+    return false;
+  }
+  millivolts = sampleMillivolts(code << 4);
+  return true;
 }
 
-void IoTNode::setUnixTime(uint32_t unixtime)
+// Reads the conversions as a continuous read in blocks that fit the
+// Wire buffer and sums 2^oversampleBits conversions for each sample
+voltageStats IoTNode::readVoltageBurst(uint32_t numberOfSamples, uint8_t oversampleBits, uint16_t *samples)
 {
-  rtc.setUnixTime(unixtime);
+  TRACE_API(*this, TRACE_VOLTAGE);
+  voltageStats stats = {0, 0, 0, 0};
+  if (oversampleBits > ADC_MAX_OVERSAMPLE_BITS)
+  {
+    oversampleBits = ADC_MAX_OVERSAMPLE_BITS;
+  }
+  uint32_t conversionsPerSample = 1UL << oversampleBits;
+  uint32_t remaining = numberOfSamples * conversionsPerSample;
+  uint32_t sum = 0;
+  uint32_t conversions = 0;
+  uint16_t minimum = 0xFFFF;
+  uint16_t maximum = 0;
+  uint64_t total = 0;
+  while (remaining > 0)
+  {
+    uint32_t count = remaining < ADC_READ_BLOCK_SIZE / 2 ? remaining : ADC_READ_BLOCK_SIZE / 2;
+    if (!requestFrom(ADC_ADDRESS, count * 2))
+    {
+      break;
+    }
+    remaining -= count;
+    while (count-- > 0)
+    {
+      uint16_t code = Wire.read() << 8;
+      code |= Wire.read();
+      sum += code & 0x0FFF;
+      if (++conversions < conversionsPerSample)
+      {
+        continue;
+      }
+      // The mean with 4 fractional bits
+      uint16_t sample = oversampleBits <= 4 ? sum << (4 - oversampleBits) : sum >> (oversampleBits - 4);
+      if (samples != NULL)
+      {
+        samples[stats.samples] = sample;
+      }
+      stats.samples++;
+      minimum = sample < minimum ? sample : minimum;
+      maximum = sample > maximum ? sample : maximum;
+      total += sample;
+      sum = 0;
+      conversions = 0;
+    }
+  }
+  if (stats.samples > 0)
+  {
+    stats.minimum = sampleMillivolts(minimum);
+    stats.mean = sampleMillivolts(total / stats.samples);
+    stats.maximum = sampleMillivolts(maximum);
+  }
+  return stats;
 }
 
-
-bool IoTNode::backupFRAMtoSD(String filename)
+uint16_t IoTNode::sampleMillivolts(uint16_t sample)
 {
-  if (!SD.begin(N_D0)) {
-    return false;
-  }
-
-  framResult res = myFram.begin();
-
-	if ( res == framBadResponse)
-	{
-		//Serial.println(F("FRAM response not OK"));
-    return false;
-	}
-	else
-	{
-		//Serial.println(F("FRAM response OK"));
-		//Serial.println();
-    
-		framResult myResult = framUnknownError;
-		unsigned int myBufferSize = myFram.getMaxBufferSize();
-		unsigned long myBottom = myFram.getBottomAddress();
-		unsigned long myTop = myFram.getTopAddress();
-
-		byte framBuffer[myBufferSize];
+  // 65536 is the full scale of a 12 bit code with 4 fractional bits
+  return ((uint32_t)sample * ADC_FULL_SCALE_MILLIVOLTS) >> 16;
+}
 
-    // Write FRAM to file
-    myFile = SD.open(filename, FILE_WRITE);
 
-    // if the file opened okay, write to it:
-    if (myFile) {
-      //Serial.print("Writing to " + filename);
-      myFile.seek(0);
-      for (unsigned long i = 0; i < myTop; i += myBufferSize)
-        {
-          readFRAM(i, myBufferSize, framBuffer);
-          myFile.write(framBuffer,myBufferSize);
-        }
-      myFile.close();
-      //Serial.println(" done.");
-      return true;
-    } else {
-      // if the file didn't open, print an error:
-      //Serial.println("error opening " + filename);
-      return false;
-    }
+uint32_t IoTNode::unixTime()
+{
+  return unixTimeMillis() / 1000;
+}
 
+uint64_t IoTNode::unixTimeMillis()
+{
+  uint32_t now = millis();
+  if (!_clockValid || _clockResyncMillis == 0 || now - _clockBaseMillis >= _clockResyncMillis)
+  {
+    syncClock();
+    now = millis();
+  }
+  uint64_t time = clockNow(now);
+  if (time < _clockLast)
+  {
+    time = _clockLast;
   }
+  _clockLast = time;
+  return time;
 }
 
-bool IoTNode::restoreFRAMfromSD(String filename)
+void IoTNode::setUnixTime(uint32_t unixtime)
 {
-  if (!SD.begin(N_D0)) {
-  //Serial.println("SD initialization failed!");
-  return false;
-  }
+  RTC_CALL(RTC_ADDRESS, rtc.setUnixTime(unixtime));
+  // Start again from the new time
+  _clockValid = false;
+  _clockLast = 0;
+  _clockStats = {0, 0, 0, 0};
+}
 
-  framResult res = myFram.begin();
-
-	if ( res == framBadResponse)
-	{
-		//Serial.println(F("FRAM response not OK"));
-    return false;
-	}
-	else
-	{
-		//Serial.println(F("FRAM response OK"));
-		//Serial.println();
-    
-		framResult myResult = framUnknownError;
-		unsigned int myBufferSize = myFram.getMaxBufferSize();
-		unsigned long myBottom = myFram.getBottomAddress();
-		unsigned long myTop = myFram.getTopAddress();
-
-		byte framBuffer[myBufferSize];
-
-    // Write file to FRAM
-    myFile = SD.open(filename, FILE_WRITE);
-    
-    // if the file opened okay, read from it:
-    if (myFile) {
-      //Serial.print("Reading from " + filename);
-      myFile.seek(0);
-      for (unsigned long i = 0; i < myTop; i += myBufferSize)
-        {
-          myFile.read(framBuffer,myBufferSize);
-          writeFRAM(i, myBufferSize, framBuffer);          
-        }
-      myFile.close();
-      //Serial.println(" done.");
+void IoTNode::setClockResync(uint32_t intervalMillis)
+{
+  // Resync before millis() differences wrap
+  _clockResyncMillis = intervalMillis < 0x7FFFFFFFUL ? intervalMillis : 0x7FFFFFFFUL;
+}
+
+// The RTC second says the time is in [rtc, rtc + 1s). The clock is only
+// moved when it is outside this second and then by the least amount, so
+// the ms phase is found over successive resyncs.
+void IoTNode::syncClock()
+{
+  uint32_t now = millis();
+  uint32_t rtcNow;
+  RTC_CALL(RTC_ADDRESS, rtcNow = rtc.rtcNow());
+  uint64_t rtcMillis = (uint64_t)rtcNow * 1000;
+  if (!_clockValid)
+  {
+    _clockBase = rtcMillis;
+    _clockBaseMillis = now;
+    _clockFirst = rtcMillis;
+    _clockFirstMillis = now;
+    _clockValid = true;
+    return;
+  }
+  uint64_t predicted = clockNow(now);
+  int32_t correction = 0;
+  if (predicted < rtcMillis)
+  {
+    correction = (int32_t)(rtcMillis - predicted);
+    predicted = rtcMillis;
+  }
+  else if (predicted >= rtcMillis + 1000)
+  {
+    correction = -(int32_t)(predicted - (rtcMillis + 999));
+    predicted = rtcMillis + 999;
+  }
+  _clockBase = predicted;
+  _clockBaseMillis = now;
+
+  _clockStats.syncs++;
+  _clockStats.lastCorrectionMillis = correction;
+  if (abs(correction) > abs(_clockStats.maxCorrectionMillis))
+  {
+    _clockStats.maxCorrectionMillis = correction;
+  }
+  // Time gained against millis() since the first sync. Includes the unknown
+  // ms phase of the first sync so settles over hours.
+  int64_t elapsed = (uint32_t)(now - _clockFirstMillis);
+  if (elapsed > 0)
+  {
+    _clockStats.driftPPM = (int32_t)(((int64_t)(_clockBase - _clockFirst) - elapsed) * 1000000 / elapsed);
+  }
+}
+
+bool IoTNode::writeScratchpad(uint8_t offset, const void *data, uint8_t numberOfBytes)
+{
+  if (offset + numberOfBytes > IOTNODE_SCRATCHPAD_SIZE)
+  {
+    return false;
+  }
+  memcpy(_scratchpad + offset, data, numberOfBytes);
+  return saveScratchpad();
+}
+
+bool IoTNode::readScratchpad(uint8_t offset, void *data, uint8_t numberOfBytes)
+{
+  if (offset + numberOfBytes > IOTNODE_SCRATCHPAD_SIZE)
+  {
+    return false;
+  }
+  memcpy(data, _scratchpad + offset, numberOfBytes);
+  return true;
+}
+
+// Reads the SRAM in blocks that fit the Wire buffer - one block when it holds 64 bytes
+bool IoTNode::loadScratchpad()
+{
+  byte sram[RTC_SRAM_SIZE];
+  bool ok = true;
+  for (uint8_t offset = 0; offset < RTC_SRAM_SIZE && ok; offset += FRAM_READ_BLOCK_SIZE)
+  {
+    uint8_t size = RTC_SRAM_SIZE - offset < FRAM_READ_BLOCK_SIZE ? RTC_SRAM_SIZE - offset : FRAM_READ_BLOCK_SIZE;
+    ok = readRTC(RTC_SRAM + offset, sram + offset, size);
+  }
+  memset(_scratchpad, 0, IOTNODE_SCRATCHPAD_SIZE);
+  if (!ok)
+  {
+    return false;
+  }
+  uint16_t magic;
+  memcpy(&magic, sram, sizeof(magic));
+  if (magic == RTC_SCRATCHPAD_MAGIC)
+  {
+    // Newest copy with a good CRC - a reset while writing only spoils the older copy
+    bool found = false;
+    for (uint8_t copy = 0; copy < 2; copy++)
+    {
+      const byte *block = sram + sizeof(magic) + copy * RTC_SCRATCHPAD_COPY;
+      uint16_t crc;
+      memcpy(&crc, block + 1 + IOTNODE_SCRATCHPAD_SIZE, sizeof(crc));
+      if (crc == crc16(block, 1 + IOTNODE_SCRATCHPAD_SIZE, 0xFFFF) &&
+          (!found || (int8_t)(block[0] - _scratchpadGeneration) > 0))
+      {
+        found = true;
+        _scratchpadCopy = copy;
+        _scratchpadGeneration = block[0];
+        memcpy(_scratchpad, block + 1, IOTNODE_SCRATCHPAD_SIZE);
+      }
+    }
+    if (found)
+    {
       return true;
-    } else {
-      // if the file didn't open, print an error:
-      //Serial.println("error opening " + filename);
+    }
+    // Neither copy survived
+    saveScratchpad();
+    return false;
+  }
+  // Not set up, the RTC lost battery power or other firmware used the SRAM
+  // Both copies are written so neither holds old values - the marker goes
+  // last so a reset before it sets up the SRAM again
+  _scratchpadCopy = 1;
+  _scratchpadGeneration = 0;
+  magic = RTC_SCRATCHPAD_MAGIC;
+  if (saveScratchpad() && saveScratchpad())
+  {
+    writeRTC(RTC_SRAM, (const byte *)&magic, sizeof(magic));
+  }
+  return false;
+}
+
+bool IoTNode::clearScratchpad()
+{
+  memset(_scratchpad, 0, IOTNODE_SCRATCHPAD_SIZE);
+  return saveScratchpad();
+}
+
+clockStats IoTNode::clockDrift()
+{
+  return _clockStats;
+}
+
+// The unix ms from millis() since the last sync
+uint64_t IoTNode::clockNow(uint32_t now)
+{
+  return _clockBase + (uint32_t)(now - _clockBaseMillis);
+}
+
+
+// Mounts the card on first use and keeps the volume mounted between
+// backups. A failed open unmounts so that a changed card is mounted again.
+bool IoTNode::mountSD()
+{
+  if (!_sdMounted)
+  {
+    _sdMounted = sdVolume().begin(iotNodeBoard::d0, SD_SCK_MHZ(_sdClockMHz));
+  }
+  return _sdMounted;
+}
+
+void IoTNode::setSDClock(uint8_t mhz)
+{
+  if (mhz == 0)
+  {
+    mhz = 1;
+  }
+  else if (mhz > iotNodeBoard::sdMaxClockMHz)
+  {
+    mhz = iotNodeBoard::sdMaxClockMHz;
+  }
+  if (mhz != _sdClockMHz)
+  {
+    _sdClockMHz = mhz;
+    _sdMounted = false;
+  }
+}
+
+void IoTNode::endSD()
+{
+  if (_sdMounted)
+  {
+    sdFile().close();
+    _sdMounted = false;
+  }
+}
+
+bool IoTNode::backupFRAMtoSD(String filename)
+{
+  TRACE_API(*this, TRACE_BACKUP);
+  uint32_t startMillis = millis();
+  lastSDTransfer.bytes = 0;
+  lastSDTransfer.milliseconds = 0;
+  lastSDTransfer.bytesPerSecond = 0;
+
+  if (!mountSD()) {
+    return false;
+  }
+
+  if (!probeI2C(FRAM_ADDRESS))
+  {
+    return false;
+  }
+
+  uint32_t framSize = _framSize;
+
+  // Replace any previous backup with a pre-allocated contiguous file
+  // so that each sector is written without cluster allocation
+  sdVolume().remove(filename.c_str());
+  if (!sdFile().createContiguous(filename.c_str(), framSize))
+  {
+    _sdMounted = false;
+    // if the file didn't open, print an error:
+    //Serial.println("error opening " + filename);
+    return false;
+  }
+
+  // Copy FRAM to the file one SD sector at a time
+  byte sector[SD_SECTOR_SIZE];
+  for (uint32_t address = 0; address < framSize; address += SD_SECTOR_SIZE)
+  {
+    uint32_t size = framSize - address;
+    if (size > SD_SECTOR_SIZE)
+    {
+      size = SD_SECTOR_SIZE;
+    }
+    // A failed read leaves the dirty map so the changes are backed up again
+    if (!readFRAM(address, size, sector) || sdFile().write(sector, size) != size)
+    {
+      sdFile().close();
+      return false;
+    }
+  }
+  sdFile().close();
+  // The backup is the new base for backupFRAMChangesToSD()
+  clearDirtyMap(false);
+
+  lastSDTransfer.bytes = framSize;
+  lastSDTransfer.milliseconds = millis() - startMillis;
+  if (lastSDTransfer.milliseconds > 0)
+  {
+    lastSDTransfer.bytesPerSecond = (uint64_t)framSize * 1000 / lastSDTransfer.milliseconds;
+  }
+  //Serial.println(" done.");
+  return true;
+}
+
+bool IoTNode::restoreFRAMfromSD(String filename)
+{
+  TRACE_API(*this, TRACE_BACKUP);
+  if (!mountSD()) {
+  //Serial.println("SD initialization failed!");
+  return false;
+  }
+
+  if (!probeI2C(FRAM_ADDRESS))
+  {
+    return false;
+  }
+
+  uint32_t framSize = _framSize;
+
+  // Read the file into FRAM
+  sdFile() = sdVolume().open(filename, O_READ);
+  if (!sdFile())
+  {
+    _sdMounted = false;
+    // if the file didn't open, print an error:
+    //Serial.println("error opening " + filename);
+    return false;
+  }
+
+  // Copy the file to FRAM one SD sector at a time
+  byte sector[SD_SECTOR_SIZE];
+  bool ok = true;
+  for (uint32_t address = 0; ok && address < framSize; address += SD_SECTOR_SIZE)
+  {
+    uint32_t size = framSize - address;
+    if (size > SD_SECTOR_SIZE)
+    {
+      size = SD_SECTOR_SIZE;
+    }
+    ok = sdFile().read(sector, size) == (int)size;
+    ok = ok && writeFRAMUntracked(address, size, sector);
+  }
+  sdFile().close();
+  // FRAM now matches the backup - or the next backup must copy all of it
+  clearDirtyMap(!ok);
+  //Serial.println(" done.");
+  return ok;
+}
+
+bool IoTNode::backupFRAMSnapshotToSD(String filename)
+{
+  TRACE_API(*this, TRACE_BACKUP);
+  uint32_t startMillis = millis();
+  lastSDTransfer.bytes = 0;
+  lastSDTransfer.milliseconds = 0;
+  lastSDTransfer.bytesPerSecond = 0;
+
+  if (!mountSD()) {
+    return false;
+  }
+
+  if (!probeI2C(FRAM_ADDRESS))
+  {
+    return false;
+  }
+
+  sdVolume().remove(filename.c_str());
+  sdFile() = sdVolume().open(filename, O_WRITE | O_CREAT | O_TRUNC);
+  if (!sdFile())
+  {
+    _sdMounted = false;
+    return false;
+  }
+
+  framSnapshotHeader header;
+  header.magic = FRAM_SNAPSHOT_MAGIC;
+  header.version = FRAM_SNAPSHOT_VERSION;
+  header.blockSize = FRAM_SNAPSHOT_BLOCK_SIZE;
+  header.framSize = _framSize;
+  header.numberOfRecords = 0;
+  header.crc = 0;
+  header.reserved = 0;
+  // Written again with the number of records at the end
+  bool ok = sdFile().write((uint8_t*)&header, sizeof(header)) == sizeof(header);
+
+  // Runs of blocks filled with a single value are saved as one record
+  framSnapshotRecord run;
+  run.type = FRAM_SNAPSHOT_FILL;
+  run.numberOfBlocks = 0;
+
+  byte sector[SD_SECTOR_SIZE];
+  for (uint32_t address = 0; ok && address < header.framSize; address += SD_SECTOR_SIZE)
+  {
+    uint32_t size = header.framSize - address;
+    if (size > SD_SECTOR_SIZE)
+    {
+      size = SD_SECTOR_SIZE;
+    }
+    // A failed read leaves the header unfinished so the file is not restored
+    ok = readFRAM(address, size, sector);
+    for (uint32_t offset = 0; ok && offset < size; offset += FRAM_SNAPSHOT_BLOCK_SIZE)
+    {
+      byte *block = sector + offset;
+      bool filled = true;
+      for (uint16_t i = 1; i < FRAM_SNAPSHOT_BLOCK_SIZE; ++i)
+      {
+        if (block[i] != block[0])
+        {
+          filled = false;
+          break;
+        }
+      }
+      if (filled && run.numberOfBlocks > 0 && run.fill == block[0] && run.numberOfBlocks < 0xFFFF)
+      {
+        ++run.numberOfBlocks;
+        continue;
+      }
+      if (run.numberOfBlocks > 0)
+      {
+        ok = writeSnapshotRecord(run, NULL);
+        ++header.numberOfRecords;
+        run.numberOfBlocks = 0;
+      }
+      if (filled)
+      {
+        run.fill = block[0];
+        run.numberOfBlocks = 1;
+      }
+      else
+      {
+        framSnapshotRecord raw;
+        raw.type = FRAM_SNAPSHOT_RAW;
+        raw.fill = 0;
+        raw.numberOfBlocks = 1;
+        ok = ok && writeSnapshotRecord(raw, block);
+        ++header.numberOfRecords;
+      }
+    }
+  }
+  if (ok && run.numberOfBlocks > 0)
+  {
+    ok = writeSnapshotRecord(run, NULL);
+    ++header.numberOfRecords;
+  }
+
+  uint32_t fileSize = sdFile().fileSize();
+  header.crc = crc16((uint8_t*)&header, sizeof(header), 0xFFFF);
+  ok = ok && sdFile().seek(0);
+  ok = ok && sdFile().write((uint8_t*)&header, sizeof(header)) == sizeof(header);
+  ok = sdFile().close() && ok;
+  if (!ok)
+  {
+    return false;
+  }
+  // The snapshot is the new base for backupFRAMChangesToSD()
+  clearDirtyMap(false);
+
+  lastSDTransfer.bytes = fileSize;
+  lastSDTransfer.milliseconds = millis() - startMillis;
+  if (lastSDTransfer.milliseconds > 0)
+  {
+    lastSDTransfer.bytesPerSecond = (uint64_t)header.framSize * 1000 / lastSDTransfer.milliseconds;
+  }
+  return true;
+}
+
+bool IoTNode::restoreFRAMSnapshotFromSD(String filename)
+{
+  TRACE_API(*this, TRACE_BACKUP);
+  if (!mountSD()) {
+    return false;
+  }
+
+  if (!probeI2C(FRAM_ADDRESS))
+  {
+    return false;
+  }
+
+  sdFile() = sdVolume().open(filename, O_READ);
+  if (!sdFile())
+  {
+    _sdMounted = false;
+    return false;
+  }
+
+  framSnapshotHeader header;
+  bool ok = sdFile().read((uint8_t*)&header, sizeof(header)) == sizeof(header);
+  uint16_t crc = header.crc;
+  header.crc = 0;
+  ok = ok && header.magic == FRAM_SNAPSHOT_MAGIC &&
+    header.version == FRAM_SNAPSHOT_VERSION &&
+    header.blockSize == FRAM_SNAPSHOT_BLOCK_SIZE &&
+    header.framSize <= _framSize &&
+    crc == crc16((uint8_t*)&header, sizeof(header), 0xFFFF);
+
+  // Check every record before anything is written to FRAM
+  byte block[FRAM_SNAPSHOT_BLOCK_SIZE];
+  framSnapshotRecord record;
+  uint32_t numberOfBlocks = 0;
+  for (uint32_t i = 0; ok && i < header.numberOfRecords; ++i)
+  {
+    ok = readSnapshotRecord(record, block);
+    numberOfBlocks += record.numberOfBlocks;
+  }
+  ok = ok && numberOfBlocks * FRAM_SNAPSHOT_BLOCK_SIZE == header.framSize;
+
+  // Then write the records
+  ok = ok && sdFile().seek(sizeof(header));
+  byte fill[SD_SECTOR_SIZE];
+  uint32_t address = 0;
+  bool written = false;
+  for (uint32_t i = 0; ok && i < header.numberOfRecords; ++i)
+  {
+    ok = readSnapshotRecord(record, block);
+    if (!ok)
+    {
+      break;
+    }
+    written = true;
+    if (record.type == FRAM_SNAPSHOT_RAW)
+    {
+      ok = writeFRAMUntracked(address, FRAM_SNAPSHOT_BLOCK_SIZE, block);
+      address += FRAM_SNAPSHOT_BLOCK_SIZE;
+    }
+    else
+    {
+      // Write the run in sector sized transfers
+      memset(fill, record.fill, sizeof(fill));
+      uint32_t remaining = (uint32_t)record.numberOfBlocks * FRAM_SNAPSHOT_BLOCK_SIZE;
+      while (ok && remaining > 0)
+      {
+        uint32_t size = remaining < sizeof(fill) ? remaining : sizeof(fill);
+        ok = writeFRAMUntracked(address, size, fill);
+        address += size;
+        remaining -= size;
+      }
+    }
+  }
+  sdFile().close();
+  if (ok)
+  {
+    // FRAM now matches the snapshot
+    clearDirtyMap(false);
+  }
+  else if (written)
+  {
+    // Partly restored so the next changes backup must include everything
+    clearDirtyMap(true);
+  }
+  return ok;
+}
+
+bool IoTNode::setBackupBlockSize(uint16_t blockSize)
+{
+  uint32_t framSize = _framSize;
+  // Must be a power of two and the map must cover the whole FRAM
+  if (blockSize == 0 || (blockSize & (blockSize - 1)) != 0 ||
+      framSize / blockSize > FRAM_DIRTY_MAP_SIZE * 8)
+  {
+    return false;
+  }
+  if (blockSize != _backupBlockSize)
+  {
+    _backupBlockSize = blockSize;
+    // The old map does not describe the new blocks
+    clearDirtyMap(true);
+  }
+  return true;
+}
+
+bool IoTNode::backupFRAMChangesToSD(String filename)
+{
+  TRACE_API(*this, TRACE_BACKUP);
+  uint32_t startMillis = millis();
+  lastSDTransfer.bytes = 0;
+  lastSDTransfer.milliseconds = 0;
+  lastSDTransfer.bytesPerSecond = 0;
+
+  uint32_t numberOfBlocks = _framSize / _backupBlockSize;
+  uint16_t changedBlocks = 0;
+  for (uint32_t block = 0; block < numberOfBlocks; ++block)
+  {
+    if (_dirtyMap[block >> 3] & (1 << (block & 7)))
+    {
+      ++changedBlocks;
+    }
+  }
+  if (changedBlocks == 0)
+  {
+    return true;
+  }
+
+  if (!mountSD()) {
+    return false;
+  }
+
+  if (!probeI2C(FRAM_ADDRESS))
+  {
+    return false;
+  }
+
+  // Append a batch of changed blocks
+  sdFile() = sdVolume().open(filename, O_WRITE | O_CREAT | O_APPEND);
+  if (!sdFile())
+  {
+    _sdMounted = false;
+    return false;
+  }
+
+  framChangesHeader header;
+  header.magic = FRAM_CHANGES_MAGIC;
+  header.blockSize = _backupBlockSize;
+  header.numberOfBlocks = changedBlocks;
+  uint32_t batchStart = sdFile().fileSize();
+  bool ok = sdFile().write((uint8_t*)&header, sizeof(header)) == sizeof(header);
+
+  byte buffer[SD_SECTOR_SIZE];
+  bool readOK = true;
+  for (uint32_t block = 0; ok && block < numberOfBlocks; ++block)
+  {
+    if (!(_dirtyMap[block >> 3] & (1 << (block & 7))))
+    {
+      continue;
+    }
+    uint16_t index = block;
+    ok = sdFile().write((uint8_t*)&index, sizeof(index)) == sizeof(index);
+    uint32_t address = block * _backupBlockSize;
+    uint32_t remaining = _backupBlockSize;
+    while (ok && remaining > 0)
+    {
+      uint32_t size = remaining < SD_SECTOR_SIZE ? remaining : SD_SECTOR_SIZE;
+      readOK = readFRAM(address, size, buffer);
+      ok = readOK && sdFile().write(buffer, size) == size;
+      address += size;
+      remaining -= size;
+    }
+  }
+  if (!readOK)
+  {
+    // Drop the unfinished batch so that restoreFRAMfromSD() can replay the file
+    sdFile().truncate(batchStart);
+  }
+  ok = sdFile().close() && ok;
+  if (!ok)
+  {
+    // Keep the map so the blocks are in the next backup
+    return false;
+  }
+  clearDirtyMap(false);
+
+  lastSDTransfer.bytes = (uint32_t)changedBlocks * _backupBlockSize;
+  lastSDTransfer.milliseconds = millis() - startMillis;
+  if (lastSDTransfer.milliseconds > 0)
+  {
+    lastSDTransfer.bytesPerSecond = (uint64_t)lastSDTransfer.bytes * 1000 / lastSDTransfer.milliseconds;
+  }
+  return true;
+}
+
+bool IoTNode::restoreFRAMfromSD(String filename, String changesFilename)
+{
+  TRACE_API(*this, TRACE_BACKUP);
+  if (!restoreFRAMfromSD(filename))
+  {
+    return false;
+  }
+
+  // No changes file - nothing has changed since the full backup
+  if (!sdVolume().exists(changesFilename.c_str()))
+  {
+    return true;
+  }
+  sdFile() = sdVolume().open(changesFilename, O_READ);
+  if (!sdFile())
+  {
+    _sdMounted = false;
+    clearDirtyMap(true);
+    return false;
+  }
+
+  // Replay each batch of changed blocks in the order they were written
+  framChangesHeader header;
+  byte buffer[SD_SECTOR_SIZE];
+  bool ok = true;
+  uint32_t framSize = _framSize;
+  while (ok && sdFile().read((uint8_t*)&header, sizeof(header)) == sizeof(header))
+  {
+    if (header.magic != FRAM_CHANGES_MAGIC || header.blockSize == 0)
+    {
+      ok = false;
+      break;
+    }
+    for (uint16_t i = 0; ok && i < header.numberOfBlocks; ++i)
+    {
+      uint16_t index;
+      ok = sdFile().read((uint8_t*)&index, sizeof(index)) == sizeof(index);
+      uint32_t address = (uint32_t)index * header.blockSize;
+      ok = ok && (address + header.blockSize <= framSize);
+      uint32_t remaining = header.blockSize;
+      while (ok && remaining > 0)
+      {
+        uint32_t size = remaining < SD_SECTOR_SIZE ? remaining : SD_SECTOR_SIZE;
+        ok = sdFile().read(buffer, size) == (int)size;
+        ok = ok && writeFRAMUntracked(address, size, buffer);
+        address += size;
+        remaining -= size;
+      }
+    }
+  }
+  sdFile().close();
+  // FRAM now matches the last backup - or the next backup must copy all of it
+  clearDirtyMap(!ok);
+  return ok;
+}
+
+void IoTNode::holdOutputs()
+{
+  _holdOutputs = true;
+}
+
+// Writes the OLATA and OLATB shadow in one transaction
+bool IoTNode::applyOutputs()
+{
+  TRACE_API(*this, TRACE_OUTPUTS);
+  _holdOutputs = false;
+  if (!_outputsChanged)
+  {
+    return true;
+  }
+  // Keeps a watchdog pulse that poll() has started
+  if (writeOutputs(_olat | (_olatWritten & EXPANDER_WATCHDOG_BIT)))
+  {
+    _outputsChanged = false;
+    return true;
+  }
+  return false;
+}
+
+// Writes OLATA and OLATB and remembers what the expander holds
+bool IoTNode::writeOutputs(uint16_t olat)
+{
+  if (!writeExpander(EXPANDER_OLATA, olat))
+  {
+    return false;
+  }
+  _olatWritten = olat;
+  return true;
+}
+
+// Private
+
+// CRC-16/CCITT
+uint16_t IoTNode::crc16(const uint8_t *data, uint32_t numberOfBytes, uint16_t crc)
+{
+  while (numberOfBytes--)
+  {
+    crc ^= (uint16_t)(*data++) << 8;
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// Writes a record and the block data for a raw record
+// The CRC covers the record and the data
+bool IoTNode::writeSnapshotRecord(framSnapshotRecord& record, const uint8_t *block)
+{
+  record.crc = 0;
+  uint16_t crc = crc16((uint8_t*)&record, sizeof(record), 0xFFFF);
+  if (record.type == FRAM_SNAPSHOT_RAW)
+  {
+    crc = crc16(block, FRAM_SNAPSHOT_BLOCK_SIZE, crc);
+  }
+  record.crc = crc;
+  if (sdFile().write((uint8_t*)&record, sizeof(record)) != sizeof(record))
+  {
+    return false;
+  }
+  if (record.type == FRAM_SNAPSHOT_RAW)
+  {
+    return sdFile().write(block, FRAM_SNAPSHOT_BLOCK_SIZE) == FRAM_SNAPSHOT_BLOCK_SIZE;
+  }
+  return true;
+}
+
+// Reads a record and the block data for a raw record and checks the CRC
+bool IoTNode::readSnapshotRecord(framSnapshotRecord& record, uint8_t *block)
+{
+  if (sdFile().read((uint8_t*)&record, sizeof(record)) != sizeof(record))
+  {
+    return false;
+  }
+  uint16_t crc = record.crc;
+  record.crc = 0;
+  uint16_t check = crc16((uint8_t*)&record, sizeof(record), 0xFFFF);
+  if (record.type == FRAM_SNAPSHOT_RAW)
+  {
+    if (record.numberOfBlocks != 1 ||
+        sdFile().read(block, FRAM_SNAPSHOT_BLOCK_SIZE) != FRAM_SNAPSHOT_BLOCK_SIZE)
+    {
+      return false;
+    }
+    check = crc16(block, FRAM_SNAPSHOT_BLOCK_SIZE, check);
+  }
+  else if (record.type != FRAM_SNAPSHOT_FILL)
+  {
+    return false;
+  }
+  record.crc = crc;
+  return crc == check;
+}
+
+int IoTNode::addRequest(requestType type, uint32_t address, uint32_t numberOfBytes, uint8_t *buffer,
+  requestCallback callback, void *context)
+{
+  for (int i = 0; i < IOTNODE_REQUEST_QUEUE_SIZE; ++i)
+  {
+    nodeRequest& request = _requests[i];
+    if (request.status == REQUEST_NONE)
+    {
+      request.type = type;
+      request.order = _requestOrder++;
+      request.address = address;
+      request.remaining = numberOfBytes;
+      request.buffer = buffer;
+      request.startMillis = 0;
+      request.started = false;
+      request.callback = callback;
+      request.context = context;
+      request.status = REQUEST_PENDING;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Runs one I2C transfer of the request
+// Returns false if the transfer failed
+bool IoTNode::runRequest(nodeRequest& request)
+{
+  if (request.remaining == 0)
+  {
+    // Done without I2C, i.e. a cached framArray
+    return true;
+  }
+  uint32_t size;
+  switch (request.type)
+  {
+    case REQUEST_FRAM_WRITE:
+      if (!request.started)
+      {
+        markDirty(request.address, request.remaining);
+        request.started = true;
+      }
+      size = request.remaining < FRAM_WRITE_BLOCK_SIZE ? request.remaining : FRAM_WRITE_BLOCK_SIZE;
+      if (!writeFRAMUntracked(request.address, size, request.buffer))
+      {
+        return false;
+      }
+      break;
+
+    case REQUEST_FRAM_READ:
+      size = request.remaining < FRAM_READ_BLOCK_SIZE ? request.remaining : FRAM_READ_BLOCK_SIZE;
+      if (!readFRAM(request.address, size, request.buffer))
+      {
+        return false;
+      }
+      break;
+
+    case REQUEST_OUTPUTS:
+      size = 1;
+      if (!applyOutputs())
+      {
+        return false;
+      }
+      break;
+
+    case REQUEST_VOLTAGE:
+    {
+      size = 1;
+      uint16_t rawVoltage;
+      if (!readADC(rawVoltage))
+      {
+        return false;
+      }
+      *(float*)request.buffer = (float)(rawVoltage)/4096.0*ADC_FULL_SCALE_VOLTS;
+      break;
+    }
+
+    case REQUEST_WATCHDOG:
+      if (!request.started)
+      {
+        // Start the pulse - poll() ends it after 50ms. Held outputs
+        // stay held.
+        request.started = true;
+        request.startMillis = millis();
+        return writeOutputs(_olatWritten | EXPANDER_WATCHDOG_BIT);
+      }
+      size = 1;
+      if (!writeOutputs(_olatWritten & ~EXPANDER_WATCHDOG_BIT))
+      {
+        return false;
+      }
+      break;
+
+    default:
+      return false;
+  }
+  request.address += size;
+  if (request.type != REQUEST_VOLTAGE && request.buffer != NULL)
+  {
+    request.buffer += size;
+  }
+  request.remaining -= size;
+  return true;
+}
+
+// Frees a request with a callback or keeps it for requestState()
+void IoTNode::finishRequest(int handle, bool ok)
+{
+  nodeRequest& request = _requests[handle];
+  requestStatus status = ok ? REQUEST_DONE : REQUEST_FAILED;
+  if (request.callback == NULL)
+  {
+    request.status = status;
+    return;
+  }
+  requestCallback callback = request.callback;
+  void *context = request.context;
+  request.status = REQUEST_NONE;
+  callback(handle, status, context);
+}
+
+void IoTNode::setOutput(uint8_t pin, bool state)
+{
+  uint16_t olat = state ? (_olat | (1 << pin)) : (_olat & ~(1 << pin));
+  if (olat != _olat)
+  {
+    _olat = olat;
+    _outputsChanged = true;
+  }
+  if (!_holdOutputs)
+  {
+    applyOutputs();
+  }
+}
+
+void IoTNode::setDirection(uint8_t pin, uint8_t mode)
+{
+  TRACE_API(*this, TRACE_OUTPUTS);
+  // IODIR 1 = input, 0 = output
+  uint16_t iodir = (mode == OUTPUT) ? (_iodir & ~(1 << pin)) : (_iodir | (1 << pin));
+  if (iodir != _iodir)
+  {
+    _iodir = iodir;
+    writeExpander(EXPANDER_IODIRA, _iodir);
+  }
+}
+
+// Writes the A and B register pair starting at regA (sequential addressing)
+bool IoTNode::writeExpander(byte regA, uint16_t value)
+{
+  byte data[2] = {(byte)(value & 0xFF), (byte)(value >> 8)};
+  return writeExpander(regA, data, 2);
+}
+
+// Reads the A and B register pair starting at regA (sequential addressing)
+bool IoTNode::readExpander(byte regA, uint16_t& value)
+{
+  byte data[2];
+  if (!readExpander(regA, data, 2))
+  {
+    return false;
+  }
+  value = data[0] | (data[1] << 8);
+  return true;
+}
+
+// Writes consecutive registers starting at reg in one transaction
+bool IoTNode::writeExpander(byte reg, const byte *data, uint8_t numberOfBytes)
+{
+  Wire.beginTransmission(EXPANDER_ADDRESS);
+  Wire.write(reg);
+  Wire.write(data, numberOfBytes);
+  return endTransmission(EXPANDER_ADDRESS, 1 + numberOfBytes) == 0;
+}
+
+int IoTNode::i2cDevice(byte address)
+{
+  // Every Fram part counts as the Fram
+  if (address > FRAM_ADDRESS && address < FRAM_ADDRESS + IOTNODE_FRAM_CHIPS)
+  {
+    address = FRAM_ADDRESS;
+  }
+  for (int i = 0; i < IOTNODE_I2C_DEVICES; ++i)
+  {
+    if (i2cAddresses[i] == address)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void IoTNode::recordI2C(byte address, uint32_t duration, bool ack)
+{
+  int device = i2cDevice(address);
+  if (device < 0)
+  {
+    return;
+  }
+  i2cDeviceHealth& health = _i2cHealth[device];
+  if (health.transactions == 0 || duration < health.minMicros)
+  {
+    health.minMicros = duration;
+  }
+  if (duration > health.maxMicros)
+  {
+    health.maxMicros = duration;
+  }
+  health.transactions++;
+  health.totalMicros += duration;
+  if (!ack)
+  {
+    health.nacks++;
+  }
+}
+
+// Wire.endTransmission with the time and result added to the device health
+// numberOfBytes is the bytes written including register or Fram address bytes
+uint8_t IoTNode::endTransmission(byte address, uint8_t numberOfBytes, bool sendStop)
+{
+  uint32_t start = micros();
+  uint8_t error = Wire.endTransmission(sendStop);
+  recordI2C(address, micros() - start, error == 0);
+#ifdef IOTNODE_I2C_TRACE
+  traceI2C(start, address, error == 0 ? TRACE_FLAG_ACK : 0, numberOfBytes);
+#else
+  (void)numberOfBytes;
+#endif
+  return error;
+}
+
+// Wire.requestFrom that checks all the bytes arrived
+bool IoTNode::requestFrom(byte address, uint8_t numberOfBytes)
+{
+  uint32_t start = micros();
+  Wire.requestFrom(address, numberOfBytes);
+  bool ok = Wire.available() == numberOfBytes;
+  recordI2C(address, micros() - start, ok);
+#ifdef IOTNODE_I2C_TRACE
+  traceI2C(start, address, TRACE_FLAG_READ | (ok ? TRACE_FLAG_ACK : 0), numberOfBytes);
+#endif
+  return ok;
+}
+
+// An MCP7941x library call counts as one transaction that was answered
+// as the library does not return the Wire result
+void IoTNode::recordCall(byte address, uint32_t start)
+{
+  recordI2C(address, micros() - start, true);
+#ifdef IOTNODE_I2C_TRACE
+  traceI2C(start, address, TRACE_FLAG_CALL, 0);
+#endif
+}
+
+#ifdef IOTNODE_I2C_TRACE
+static const char *traceApiNames[] =
+{
+  "other", "begin", "ok", "outputs", "inputs", "watchdog", "voltage",
+  "framArray", "framRing", "backup", "poll", "flush", "sleep"
+};
+
+// Counts a transaction against the outermost API call and adds it to the trace
+void IoTNode::traceI2C(uint32_t start, byte address, uint8_t flags, uint8_t numberOfBytes)
+{
+  uint32_t duration = micros() - start;
+  _traceApis[_traceApi].transactions++;
+  _traceApis[_traceApi].bytes += numberOfBytes;
+  _traceApis[_traceApi].micros += duration;
+  int device = i2cDevice(address);
+  if (device >= 0)
+  {
+    _traceDevices[device].transactions++;
+    _traceDevices[device].bytes += numberOfBytes;
+    _traceDevices[device].micros += duration;
+  }
+  i2cTraceRecord& record = _trace[_traceNext];
+  record.startMicros = start;
+  record.durationMicros = duration > 0xFFFF ? 0xFFFF : duration;
+  record.address = address;
+  record.api = _traceApi;
+  record.bytes = numberOfBytes;
+  record.flags = flags;
+  _traceNext = (_traceNext + 1) % IOTNODE_I2C_TRACE_SIZE;
+  if (_traceCount < IOTNODE_I2C_TRACE_SIZE)
+  {
+    _traceCount++;
+  }
+}
+
+IoTNode::traceScope::traceScope(IoTNode& node, traceApi api) : myNode(node), _api(node._traceApi)
+{
+  // Nested calls count against the outermost API
+  if (_api == TRACE_OTHER)
+  {
+    myNode._traceApi = api;
+  }
+}
+
+IoTNode::traceScope::~traceScope()
+{
+  myNode._traceApi = _api;
+}
+
+// Prints "name transactions bytes micros"
+static void printTraceCounters(Print& out, uint32_t transactions, uint32_t bytes, uint32_t micros)
+{
+  out.print(' ');
+  out.print(transactions);
+  out.print(' ');
+  out.print(bytes);
+  out.print(' ');
+  out.println(micros);
+}
+
+void IoTNode::dumpI2CTrace(Print& out)
+{
+  out.println("I2C api transactions bytes micros");
+  for (int i = 0; i < TRACE_API_COUNT; ++i)
+  {
+    if (_traceApis[i].transactions > 0)
+    {
+      out.print(traceApiNames[i]);
+      printTraceCounters(out, _traceApis[i].transactions, _traceApis[i].bytes, _traceApis[i].micros);
+    }
+  }
+  out.println("I2C address transactions bytes micros");
+  for (int i = 0; i < IOTNODE_I2C_DEVICES; ++i)
+  {
+    if (_traceDevices[i].transactions > 0)
+    {
+      out.print("0x");
+      out.print(i2cAddresses[i], HEX);
+      printTraceCounters(out, _traceDevices[i].transactions, _traceDevices[i].bytes, _traceDevices[i].micros);
+    }
+  }
+  out.println("I2C trace micros api address R/W/C bytes micros ack");
+  uint16_t index = (_traceNext + IOTNODE_I2C_TRACE_SIZE - _traceCount) % IOTNODE_I2C_TRACE_SIZE;
+  for (uint16_t i = 0; i < _traceCount; ++i)
+  {
+    i2cTraceRecord& record = _trace[index];
+    out.print(record.startMicros);
+    out.print(' ');
+    out.print(traceApiNames[record.api]);
+    out.print(" 0x");
+    out.print(record.address, HEX);
+    // C and ? for an MCP7941x library call
+    bool call = record.flags & TRACE_FLAG_CALL;
+    out.print(call ? " C " : ((record.flags & TRACE_FLAG_READ) ? " R " : " W "));
+    out.print(record.bytes);
+    out.print(' ');
+    out.print(record.durationMicros);
+    out.println(call ? " ?" : ((record.flags & TRACE_FLAG_ACK) ? " Y" : " N"));
+    index = (index + 1) % IOTNODE_I2C_TRACE_SIZE;
+  }
+}
+
+void IoTNode::clearI2CTrace()
+{
+  memset(_traceApis, 0, sizeof(_traceApis));
+  memset(_traceDevices, 0, sizeof(_traceDevices));
+  _traceNext = 0;
+  _traceCount = 0;
+}
+#endif
+
+// Writes the scratchpad with the next generation and its CRC over the older SRAM copy
+// One transfer when the copy fits the Wire buffer
+bool IoTNode::saveScratchpad()
+{
+  byte block[RTC_SCRATCHPAD_COPY];
+  block[0] = _scratchpadGeneration + 1;
+  memcpy(block + 1, _scratchpad, IOTNODE_SCRATCHPAD_SIZE);
+  uint16_t crc = crc16(block, 1 + IOTNODE_SCRATCHPAD_SIZE, 0xFFFF);
+  memcpy(block + 1 + IOTNODE_SCRATCHPAD_SIZE, &crc, sizeof(crc));
+  uint8_t copy = _scratchpadCopy ^ 1;
+  byte reg = RTC_SRAM + sizeof(uint16_t) + copy * RTC_SCRATCHPAD_COPY;
+  bool ok = true;
+  for (uint8_t offset = 0; offset < RTC_SCRATCHPAD_COPY && ok; offset += RTC_WRITE_BLOCK_SIZE)
+  {
+    uint8_t size = RTC_SCRATCHPAD_COPY - offset < RTC_WRITE_BLOCK_SIZE ? RTC_SCRATCHPAD_COPY - offset : RTC_WRITE_BLOCK_SIZE;
+    ok = writeRTC(reg + offset, block + offset, size);
+  }
+  if (ok)
+  {
+    _scratchpadCopy = copy;
+    _scratchpadGeneration = block[0];
+  }
+  return ok;
+}
+
+// Writes consecutive RTC registers starting at reg in one transaction
+bool IoTNode::writeRTC(byte reg, const byte *data, uint8_t numberOfBytes)
+{
+  Wire.beginTransmission(RTC_ADDRESS);
+  Wire.write(reg);
+  Wire.write(data, numberOfBytes);
+  return endTransmission(RTC_ADDRESS, 1 + numberOfBytes) == 0;
+}
+
+// Reads one MCP3221 conversion - the MSB is sent first
+bool IoTNode::readADC(uint16_t& code)
+{
+  if (!requestFrom(ADC_ADDRESS, 2))
+  {
+    return false;
+  }
+  code = Wire.read() << 8;
+  code |= Wire.read();
+  code &= 0x0FFF;
+  return true;
+}
+
+// Reads consecutive RTC registers starting at reg in one transaction
+bool IoTNode::readRTC(byte reg, byte *data, uint8_t numberOfBytes)
+{
+  Wire.beginTransmission(RTC_ADDRESS);
+  Wire.write(reg);
+  if (endTransmission(RTC_ADDRESS, 1) != 0)
+  {
+    return false;
+  }
+  if (!requestFrom(RTC_ADDRESS, numberOfBytes))
+  {
+    return false;
+  }
+  for (uint8_t i = 0; i < numberOfBytes; ++i)
+  {
+    data[i] = Wire.read();
+  }
+  return true;
+}
+
+// Reads consecutive registers starting at reg in one transaction
+bool IoTNode::readExpander(byte reg, byte *data, uint8_t numberOfBytes)
+{
+  Wire.beginTransmission(EXPANDER_ADDRESS);
+  Wire.write(reg);
+  if (endTransmission(EXPANDER_ADDRESS, 1) != 0)
+  {
+    return false;
+  }
+  if (!requestFrom(EXPANDER_ADDRESS, numberOfBytes))
+  {
+    return false;
+  }
+  for (uint8_t i = 0; i < numberOfBytes; ++i)
+  {
+    data[i] = Wire.read();
+  }
+  return true;
+}
+
+void IoTNode::array_to_string(byte array[], unsigned int len, char buffer[])
+{
+    for (unsigned int i = 0; i < len; i++)
+    {
+        byte nib1 = (array[i] >> 4) & 0x0F;
+        byte nib2 = (array[i] >> 0) & 0x0F;
+        buffer[i*2+0] = nib1  < 0xA ? '0' + nib1  : 'A' + nib1  - 0xA;
+        buffer[i*2+1] = nib2  < 0xA ? '0' + nib2  : 'A' + nib2  - 0xA;
+    }
+    buffer[len*2] = '\0';
+}
+
+// Hands out consecutive fram regions to framArray and framRing
+// in the order that they are created
+uint32_t IoTNode::allocateFRAM(uint32_t numberOfBytes, framResult& result)
+{
+  uint32_t address = _framNextAddress;
+  if (numberOfBytes == 0)
+  {
+    result = framBadNumberOfBytes;
+    return address;
+  }
+  // Below the named partitions - begin() reads where they start
+  if (address + numberOfBytes > _partitionsAddress)
+  {
+    result = framBadFinishAddress;
+    return address;
+  }
+  _framNextAddress += numberOfBytes;
+  result = framOK;
+  return address;
+}
+
+uint32_t IoTNode::directoryAddress()
+{
+  return _framSize - IOTNODE_FRAM_DIRECTORY_SIZE;
+}
+
+// Finds a named partition, reading the directory a few entries at a time,
+// or adds it below the lowest partition. A partition that changes keeps its
+// space when the new size fits and the lowest partition grows down in place.
+// Other partitions never move.
+bool IoTNode::findPartition(const char *name, uint16_t type, uint32_t numberOfElements, uint32_t sizeOfElement,
+  uint16_t version, uint32_t numberOfBytes, uint32_t& address, bool& created)
+{
+  framDirectoryHeader header;
+  uint32_t dirAddress = directoryAddress();
+  uint32_t entriesAddress = dirAddress + sizeof(framDirectoryHeader);
+  created = false;
+
+  if (!readDirectoryHeader(header))
+  {
+    return false;
+  }
+
+  framDirectoryEntry entries[FRAM_DIRECTORY_SCAN_ENTRIES];
+  framDirectoryEntry entry;
+  bool found = false;
+  uint16_t index = 0;
+  while (!found && index < header.numberOfEntries)
+  {
+    uint16_t count = header.numberOfEntries - index;
+    if (count > FRAM_DIRECTORY_SCAN_ENTRIES)
+    {
+      count = FRAM_DIRECTORY_SCAN_ENTRIES;
+    }
+    if (!readFRAM(entriesAddress + index * sizeof(framDirectoryEntry), count * sizeof(framDirectoryEntry),
+        (uint8_t*)entries))
+    {
+      return false;
+    }
+    for (uint16_t i = 0; i < count && !found; ++i)
+    {
+      if (strncmp(entries[i].name, name, IOTNODE_FRAM_NAME_SIZE) == 0)
+      {
+        entry = entries[i];
+        found = true;
+      }
+      else
+      {
+        ++index;
+      }
+    }
+  }
+  if (!found && index == FRAM_DIRECTORY_ENTRIES)
+  {
+    // Directory is full
+    myResult = framBadArrayStartAddress;
+    return false;
+  }
+  if (found && entry.address < _framNextAddress)
+  {
+    // Unnamed arrays and rings added by an update reach into the partition
+    myResult = framBadFinishAddress;
+    return false;
+  }
+  if (found && entry.type == type && entry.version == version &&
+      entry.numberOfElements == numberOfElements && entry.sizeOfElement == sizeOfElement)
+  {
+    address = entry.address;
+    return true;
+  }
+
+  uint32_t lowestAddress = header.lowestAddress;
+  if (found && numberOfBytes <= entry.numberOfBytes)
+  {
+    // Reuse the space - the entry keeps its reserved size
+  }
+  else if (found && entry.address == header.lowestAddress &&
+    entry.address + entry.numberOfBytes >= _framNextAddress + numberOfBytes)
+  {
+    // The lowest partition grows down into free space
+    entry.address = entry.address + entry.numberOfBytes - numberOfBytes;
+    entry.numberOfBytes = numberOfBytes;
+    header.lowestAddress = entry.address;
+  }
+  else if (header.lowestAddress >= _framNextAddress + numberOfBytes)
+  {
+    // New space below the lowest partition and above the unnamed arrays and rings
+    header.lowestAddress -= numberOfBytes;
+    if (!found)
+    {
+      memset(&entry, 0, sizeof(entry));
+      strncpy(entry.name, name, IOTNODE_FRAM_NAME_SIZE - 1);
+    }
+    entry.address = header.lowestAddress;
+    entry.numberOfBytes = numberOfBytes;
+  }
+  else
+  {
+    myResult = framBadFinishAddress;
+    return false;
+  }
+  entry.numberOfElements = numberOfElements;
+  entry.sizeOfElement = sizeOfElement;
+  entry.version = version;
+  entry.type = type;
+
+  // Space is taken in the header before a saved entry points to it, and a
+  // new entry is saved before the header that makes it valid
+  bool ok = true;
+  if (found && header.lowestAddress != lowestAddress)
+  {
+    ok = writeFRAM(dirAddress, sizeof(header), (uint8_t*)&header);
+  }
+  ok = ok && writeFRAM(entriesAddress + index * sizeof(framDirectoryEntry), sizeof(entry), (uint8_t*)&entry);
+  if (ok && !found)
+  {
+    ++header.numberOfEntries;
+    ok = writeFRAM(dirAddress, sizeof(header), (uint8_t*)&header);
+  }
+  if (!ok)
+  {
+    return false;
+  }
+  _partitionsAddress = header.lowestAddress;
+  address = entry.address;
+  created = true;
+  return true;
+}
+
+// Reads the directory header or sets up a new one if it is not valid
+bool IoTNode::readDirectoryHeader(framDirectoryHeader& header)
+{
+  uint32_t dirAddress = directoryAddress();
+  if (!readFRAM(dirAddress, sizeof(header), (uint8_t*)&header))
+  {
+    return false;
+  }
+  if (header.magic != FRAM_DIRECTORY_MAGIC || header.numberOfEntries > FRAM_DIRECTORY_ENTRIES ||
+      header.lowestAddress > dirAddress)
+  {
+    // New directory
+    header.magic = FRAM_DIRECTORY_MAGIC;
+    header.numberOfEntries = 0;
+    header.reserved = 0;
+    header.lowestAddress = dirAddress;
+    header.reserved2 = 0;
+  }
+  return true;
+}
+
+bool IoTNode::clearPartitions()
+{
+  framDirectoryHeader header;
+  memset(&header, 0, sizeof(header));
+  if (!writeFRAM(directoryAddress(), sizeof(header), (uint8_t*)&header))
+  {
+    return false;
+  }
+  _partitionsAddress = directoryAddress();
+  return true;
+}
+
+// Marks the blocks as changed since the last backup and writes
+bool IoTNode::writeFRAM(uint32_t startaddress, uint32_t numberOfBytes, uint8_t *buffer)
+{
+  markDirty(startaddress, numberOfBytes);
+  return writeFRAMUntracked(startaddress, numberOfBytes, buffer);
+}
+
+// Sets the dirty bits for the blocks and saves any newly set
+// bits so that the map survives a power cycle
+void IoTNode::markDirty(uint32_t startaddress, uint32_t numberOfBytes)
+{
+  if (numberOfBytes == 0)
+  {
+    return;
+  }
+  uint32_t firstBlock = startaddress / _backupBlockSize;
+  uint32_t lastBlock = (startaddress + numberOfBytes - 1) / _backupBlockSize;
+  uint32_t firstChanged = FRAM_DIRTY_MAP_SIZE;
+  uint32_t lastChanged = 0;
+  for (uint32_t block = firstBlock; block <= lastBlock && block < FRAM_DIRTY_MAP_SIZE * 8; ++block)
+  {
+    byte bit = 1 << (block & 7);
+    if (!(_dirtyMap[block >> 3] & bit))
+    {
+      _dirtyMap[block >> 3] |= bit;
+      if (firstChanged > (block >> 3))
+      {
+        firstChanged = block >> 3;
+      }
+      lastChanged = block >> 3;
+    }
+  }
+  if (firstChanged < FRAM_DIRTY_MAP_SIZE)
+  {
+    writeFRAMUntracked(_systemAddress + FRAM_DIRTY_MAP_OFFSET + firstChanged,
+      lastChanged - firstChanged + 1, _dirtyMap + firstChanged);
+  }
+}
+
+void IoTNode::loadDirtyMap()
+{
+  uint16_t blockSize = 0;
+  readFRAM(_systemAddress + FRAM_DIRTY_BLOCK_SIZE_OFFSET, sizeof(blockSize), (uint8_t*)&blockSize);
+  if (blockSize == _backupBlockSize)
+  {
+    readFRAM(_systemAddress + FRAM_DIRTY_MAP_OFFSET, FRAM_DIRTY_MAP_SIZE, _dirtyMap);
+  }
+  else
+  {
+    // Saved with a different block size (or never saved)
+    clearDirtyMap(true);
+  }
+}
+
+// Sets every block to dirty or clean and saves the map
+void IoTNode::clearDirtyMap(bool dirty)
+{
+  memset(_dirtyMap, dirty ? 0xFF : 0x00, sizeof(_dirtyMap));
+  writeFRAMUntracked(_systemAddress + FRAM_DIRTY_BLOCK_SIZE_OFFSET, sizeof(_backupBlockSize), (uint8_t*)&_backupBlockSize);
+  writeFRAMUntracked(_systemAddress + FRAM_DIRTY_MAP_OFFSET, sizeof(_dirtyMap), _dirtyMap);
+}
+
+bool IoTNode::writeFRAMUntracked(uint32_t startaddress, uint32_t numberOfBytes, uint8_t *buffer)
+{
+  // Write in blocks that fit the Wire buffer with the two address bytes
+  // and that do not cross a part or bank
+  byte* buf = buffer;
+  uint32_t address = startaddress;
+  bool ok = true;
+
+  while (numberOfBytes > 0)
+  {
+    byte device;
+    uint16_t offset;
+    uint32_t size = framSegment(address, numberOfBytes, device, offset);
+    if (size == 0)
+    {
+      return false;
+    }
+    if (size > FRAM_WRITE_BLOCK_SIZE)
+    {
+      size = FRAM_WRITE_BLOCK_SIZE;
+    }
+    Wire.beginTransmission(device);
+    Wire.write((byte)(offset >> 8));
+    Wire.write((byte)(offset & 0xFF));
+    Wire.write(buf, size);
+    if (endTransmission(device, 2 + size) != 0)
+    {
+      ok = false;
+    }
+    address += size;
+    buf += size;
+    numberOfBytes -= size;
+  }
+  return ok;
+}
+
+bool IoTNode::readFRAM(uint32_t startaddress, uint32_t numberOfBytes, uint8_t *buffer)
+{
+  // For each part and bank send the address once and then continue with
+  // current address reads in blocks that fit the Wire buffer. The FRAM
+  // address counter increments across the reads.
+  byte* buf = buffer;
+  uint32_t address = startaddress;
+  while (numberOfBytes > 0)
+  {
+    byte device;
+    uint16_t offset;
+    uint32_t segment = framSegment(address, numberOfBytes, device, offset);
+    if (segment == 0)
+    {
+      return false;
+    }
+    Wire.beginTransmission(device);
+    Wire.write((byte)(offset >> 8));
+    Wire.write((byte)(offset & 0xFF));
+    if (endTransmission(device, 2, false) != 0)
+    {
+      return false;
+    }
+
+    address += segment;
+    numberOfBytes -= segment;
+    while (segment > 0)
+    {
+      uint8_t size = segment < FRAM_READ_BLOCK_SIZE ? segment : FRAM_READ_BLOCK_SIZE;
+      if (!requestFrom(device, size))
+      {
+        return false;
+      }
+      for (uint8_t i = 0; i < size; ++i)
+      {
+        *buf++ = Wire.read();
+      }
+      segment -= size;
+    }
+  }
+  return true;
+}
+
+// Finds the I2C address and the address within its bank for a Fram
+// address and returns how many bytes
+// from there are in the same part and bank - 0 if beyond the Fram
+uint32_t IoTNode::framSegment(uint32_t address, uint32_t numberOfBytes, byte& device, uint16_t& offset)
+{
+  uint32_t start = 0;
+  for (uint8_t i = 0; i < _framChipCount; ++i)
+  {
+    if (address < start + _framChips[i].size)
+    {
+      uint32_t partAddress = address - start;
+      device = _framChips[i].address + partAddress / FRAM_BANK_SIZE;
+      offset = partAddress % FRAM_BANK_SIZE;
+      // Up to the end of the bank or part, whichever is first
+      uint32_t left = FRAM_BANK_SIZE - offset;
+      if (left > _framChips[i].size - partAddress)
+      {
+        left = _framChips[i].size - partAddress;
+      }
+      return numberOfBytes < left ? numberOfBytes : left;
+    }
+    start += _framChips[i].size;
+  }
+  return 0;
+}
+
+// Size in bytes from the Fujitsu device ID - 0 if it can not be read
+uint32_t IoTNode::framPartSize(byte address)
+{
+  Wire.beginTransmission(FRAM_ID_ADDRESS);
+  Wire.write((byte)(address << 1));
+  if (endTransmission(FRAM_ID_ADDRESS, 1, false) != 0 ||
+      !requestFrom(FRAM_ID_ADDRESS, 3))
+  {
+    return 0;
+  }
+  byte id[3];
+  for (uint8_t i = 0; i < 3; ++i)
+  {
+    id[i] = Wire.read();
+  }
+  uint16_t manufacturer = ((uint16_t)id[0] << 4) | (id[1] >> 4);
+  byte density = id[1] & 0x0F;
+  // Density 3 is 64 kbit (8 KB) through 7 for 1 Mbit (128 KB)
+  if (manufacturer != FRAM_ID_FUJITSU || density < 3 || density > 9)
+  {
+    return 0;
+  }
+  return 1UL << (density + 10);
+}
+
+// Joins the Fram parts from 0x50 up into one address space. Stops at the
+// first address that does not answer or that can not be identified.
+void IoTNode::detectFRAM()
+{
+  framChip chips[IOTNODE_FRAM_CHIPS];
+  uint8_t count = 0;
+  byte address = FRAM_ADDRESS;
+  while (address < FRAM_ADDRESS + IOTNODE_FRAM_CHIPS && count < IOTNODE_FRAM_CHIPS)
+  {
+    // A missing part is not a bus error so it is not counted as one
+    Wire.beginTransmission(address);
+    if (Wire.endTransmission() != 0)
+    {
+      break;
+    }
+    uint32_t partSize = framPartSize(address);
+    if (partSize == 0)
+    {
+      break;
+    }
+    uint8_t banks = (partSize + FRAM_BANK_SIZE - 1) / FRAM_BANK_SIZE;
+    if (address + banks > FRAM_ADDRESS + IOTNODE_FRAM_CHIPS)
+    {
+      break;
+    }
+    chips[count].address = address;
+    chips[count].size = partSize;
+    ++count;
+    address += banks;
+  }
+  useFRAM(chips, count);
+}
+
+// Sets the Fram parts found by detectFRAM() or saved in the boot record
+void IoTNode::useFRAM(const framChip *chips, uint8_t count)
+{
+  if (count == 0)
+  {
+    // Keep the default part - the older parts without a device ID
+    return;
+  }
+  _framChipCount = count;
+  _framSize = 0;
+  for (uint8_t i = 0; i < count; ++i)
+  {
+    _framChips[i] = chips[i];
+    _framSize += chips[i].size;
+  }
+
+  // The dirty map must cover the whole Fram
+  while (_framSize / _backupBlockSize > FRAM_DIRTY_MAP_SIZE * 8)
+  {
+    _backupBlockSize <<= 1;
+  }
+
+  // framArray and framRing objects created before begin() must still
+  // be below the named partitions - those that are not fail when used
+  framDirectoryHeader header;
+  _partitionsAddress = directoryAddress();
+  if (readDirectoryHeader(header))
+  {
+    _partitionsAddress = header.lowestAddress;
+  }
+  if (_framNextAddress > _partitionsAddress)
+  {
+    myResult = framBadFinishAddress;
+  }
+}
+
+//////////////////
+
+// Fram Array Constructor
+framArray::framArray(IoTNode& node, uint32_t numberOfElements, byte sizeOfElement, framResult& result):
+  _numberOfElements(numberOfElements), _sizeOfElement(sizeOfElement), myNode(node), myResult(result)
+{
+  _startAddress = myNode.allocateFRAM(_numberOfElements * _sizeOfElement, myResult);
+}
+
+framArray::framArray(IoTNode& node, uint32_t startAddress, uint32_t numberOfElements, uint32_t sizeOfElement, framResult& result):
+  _numberOfElements(numberOfElements), _sizeOfElement(sizeOfElement), myNode(node), myResult(result),
+  _startAddress(startAddress)
+{
+  myResult = framOK;
+}
+
+// Named array - located in the partition directory on first use
+framArray::framArray(IoTNode& node, const char *name, uint16_t version, uint32_t numberOfElements, byte sizeOfElement, framResult& result):
+  _numberOfElements(numberOfElements), _sizeOfElement(sizeOfElement), myNode(node), myResult(result),
+  _startAddress(0), _name(name), _version(version), _located(false)
+{
+  myResult = framOK;
+}
+
+framArray::framArray(const framArray& other):
+  _numberOfElements(other._numberOfElements), _sizeOfElement(other._sizeOfElement), myNode(other.myNode),
+  myResult(other.myResult), _startAddress(other._startAddress), _name(other._name), _version(other._version),
+  _located(other._located), _cache(other._cache), _firstChanged(other._firstChanged),
+  _lastChanged(other._lastChanged), _changed(other._changed), _writes(other._writes),
+  _flushEveryWrites(other._flushEveryWrites), _flushEveryMillis(other._flushEveryMillis),
+  _lastFlushMillis(other._lastFlushMillis)
+{
+  if (_cache != NULL)
+  {
+    // The copy is flushed by IoTNode::flush() too
+    _nextCached = myNode._cachedArrays;
+    myNode._cachedArrays = this;
+  }
+}
+
+// Leaves the arrays flushed by IoTNode::flush() so that none is left
+// pointing at a scoped or copied array that has gone
+framArray::~framArray()
+{
+  for (framArray **array = &myNode._cachedArrays; *array != NULL; array = &(*array)->_nextCached)
+  {
+    if (*array == this)
+    {
+      *array = _nextCached;
+      break;
+    }
+  }
+}
+
+framArray IoTNode::makeFramArray(uint32_t numberOfElements, byte sizeOfElement)
+{
+  return framArray(*this, numberOfElements,sizeOfElement, myResult);
+}
+
+framArray IoTNode::makeFramArray(const char *name, uint32_t numberOfElements, byte sizeOfElement, uint16_t version)
+{
+  return framArray(*this, name, version, numberOfElements, sizeOfElement, myResult);
+}
+
+// Locates a named array the first time it is used. An unnamed array
+// must end below the named partitions.
+bool framArray::ready()
+{
+  if (_name == NULL)
+  {
+    if (_startAddress + _numberOfElements * _sizeOfElement > myNode._partitionsAddress)
+    {
+      myResult = framBadFinishAddress;
+      return false;
+    }
+    return true;
+  }
+  if (!_located)
+  {
+    bool created;
+    _located = myNode.findPartition(_name, FRAM_PARTITION_ARRAY, _numberOfElements, _sizeOfElement,
+      _version, _numberOfElements * _sizeOfElement, _startAddress, created);
+  }
+  return _located;
+}
+
+bool framArray::write(uint32_t index, byte *buffer)
+{
+  TRACE_API(myNode, TRACE_FRAM_ARRAY);
+  if (!ready())
+  {
+    return false;
+  }
+  if (index >= _numberOfElements)
+  {
+    myResult = framBadArrayIndex;
+    return false;
+  }
+  if (_cache == NULL)
+  {
+    if (!myNode.writeFRAM(_startAddress + index * _sizeOfElement, _sizeOfElement, buffer))
+    {
+      myResult = framBadResponse;
+      return false;
+    }
+    return true;
+  }
+
+  memcpy(_cache + index * _sizeOfElement, buffer, _sizeOfElement);
+  if (!_changed)
+  {
+    _firstChanged = index;
+    _lastChanged = index;
+    _changed = true;
+  }
+  else if (index < _firstChanged)
+  {
+    _firstChanged = index;
+  }
+  else if (index > _lastChanged)
+  {
+    _lastChanged = index;
+  }
+  ++_writes;
+  if ((_flushEveryWrites > 0 && _writes >= _flushEveryWrites) ||
+      (_flushEveryMillis > 0 && millis() - _lastFlushMillis >= _flushEveryMillis))
+  {
+    flush();
+  }
+  return true;
+}
+
+bool framArray::read(uint32_t index, byte *buffer)
+{
+  TRACE_API(myNode, TRACE_FRAM_ARRAY);
+  if (!ready())
+  {
+    return false;
+  }
+  if (index >= _numberOfElements)
+  {
+    myResult = framBadArrayIndex;
+    return false;
+  }
+  if (_cache == NULL)
+  {
+    if (!myNode.readFRAM(_startAddress + index * _sizeOfElement, _sizeOfElement, buffer))
+    {
+      myResult = framBadResponse;
+      return false;
+    }
+  }
+  else
+  {
+    memcpy(buffer, _cache + index * _sizeOfElement, _sizeOfElement);
+  }
+  return true;
+}
+
+int framArray::requestWrite(uint32_t index, byte *buffer, requestCallback callback, void *context)
+{
+  if (!ready())
+  {
+    return -1;
+  }
+  if (index >= _numberOfElements)
+  {
+    myResult = framBadArrayIndex;
+    return -1;
+  }
+  if (_cache != NULL)
+  {
+    write(index, buffer);
+    return myNode.addRequest(IoTNode::REQUEST_FRAM_WRITE, 0, 0, NULL, callback, context);
+  }
+  return myNode.addRequest(IoTNode::REQUEST_FRAM_WRITE, _startAddress + index * _sizeOfElement,
+    _sizeOfElement, buffer, callback, context);
+}
+
+int framArray::requestRead(uint32_t index, byte *buffer, requestCallback callback, void *context)
+{
+  if (!ready())
+  {
+    return -1;
+  }
+  if (index >= _numberOfElements)
+  {
+    myResult = framBadArrayIndex;
+    return -1;
+  }
+  if (_cache != NULL)
+  {
+    read(index, buffer);
+    return myNode.addRequest(IoTNode::REQUEST_FRAM_READ, 0, 0, NULL, callback, context);
+  }
+  return myNode.addRequest(IoTNode::REQUEST_FRAM_READ, _startAddress + index * _sizeOfElement,
+    _sizeOfElement, buffer, callback, context);
+}
+
+void framArray::enableCache(byte *cache, uint16_t flushEveryWrites, uint32_t flushEveryMillis)
+{
+  TRACE_API(myNode, TRACE_FRAM_ARRAY);
+  if (!ready())
+  {
+    return;
+  }
+  if (_cache == NULL)
+  {
+    // Add to the arrays flushed by IoTNode::flush()
+    _nextCached = myNode._cachedArrays;
+    myNode._cachedArrays = this;
+  }
+  else
+  {
+    flush();
+  }
+  _cache = cache;
+  _flushEveryWrites = flushEveryWrites;
+  _flushEveryMillis = flushEveryMillis;
+  _changed = false;
+  _writes = 0;
+  _lastFlushMillis = millis();
+  myNode.readFRAM(_startAddress, _numberOfElements * _sizeOfElement, _cache);
+}
+
+// Writes the changed elements as one run
+void framArray::flush()
+{
+  TRACE_API(myNode, TRACE_FRAM_ARRAY);
+  if (_cache != NULL && _changed)
+  {
+    uint32_t offset = _firstChanged * _sizeOfElement;
+    // Keep the changes for the next flush if the write fails
+    if (myNode.writeFRAM(_startAddress + offset, (_lastChanged - _firstChanged + 1) * _sizeOfElement, _cache + offset))
+    {
+      _changed = false;
+    }
+    else
+    {
+      myResult = framBadResponse;
+    }
+  }
+  _writes = 0;
+  _lastFlushMillis = millis();
+}
+
+
+//////////////////
+
+// Fram Ring Array Constructor
+// The ring pointers are stored in fram in front of the elements
+// With a commit interval above 1 each slot starts with a sequence number
+framRing::framRing(IoTNode& node, uint32_t numberOfElements, byte sizeOfElement, uint16_t commitInterval, framResult& result):
+  _numberOfElements(numberOfElements), _sizeOfElement(sizeOfElement), myNode(node), myResult(result)
+{
+  setCommitInterval(commitInterval);
+  _startAddress = myNode.allocateFRAM(sizeof(ringPointers) + _numberOfElements * _slotSize, myResult);
+}
+
+framRing::framRing(IoTNode& node, uint32_t startAddress, uint32_t numberOfElements, uint32_t sizeOfElement, framResult& result):
+  _numberOfElements(numberOfElements), _sizeOfElement(sizeOfElement), myNode(node), myResult(result),
+  _startAddress(startAddress)
+{
+  setCommitInterval(1);
+  myResult = framOK;
+}
+
+// Named ring - located in the partition directory on first use
+framRing::framRing(IoTNode& node, const char *name, uint16_t version, uint32_t numberOfElements, byte sizeOfElement,
+  uint16_t commitInterval, framResult& result):
+  _numberOfElements(numberOfElements), _sizeOfElement(sizeOfElement), myNode(node), myResult(result),
+  _startAddress(0), _name(name), _version(version), _located(false)
+{
+  setCommitInterval(commitInterval);
+  myResult = framOK;
+}
+
+framRing::framRing(const framRing& other):
+  _numberOfElements(other._numberOfElements), _sizeOfElement(other._sizeOfElement), myNode(other.myNode),
+  myResult(other.myResult), _startAddress(other._startAddress), _pointers(other._pointers),
+  _slotSize(other._slotSize), _commitInterval(other._commitInterval), _uncommitted(other._uncommitted),
+  _timestampOffset(other._timestampOffset), _name(other._name), _version(other._version),
+  _located(other._located), _unread(other._unread)
+{
+  if (other._registered)
+  {
+    // The copy is committed by IoTNode::flush() too
+    _nextLazy = myNode._lazyRings;
+    myNode._lazyRings = this;
+    _registered = true;
+  }
+}
+
+// Leaves the rings committed by IoTNode::flush()
+framRing::~framRing()
+{
+  for (framRing **ring = &myNode._lazyRings; *ring != NULL; ring = &(*ring)->_nextLazy)
+  {
+    if (*ring == this)
+    {
+      *ring = _nextLazy;
+      break;
+    }
+  }
+}
+
+framRing IoTNode::makeFramRing(uint32_t numberOfElements, byte sizeOfElement, uint16_t commitInterval)
+{
+  return framRing(*this, numberOfElements,sizeOfElement, commitInterval, myResult);
+}
+
+framRing IoTNode::makeFramRing(const char *name, uint32_t numberOfElements, byte sizeOfElement, uint16_t version, uint16_t commitInterval)
+{
+  return framRing(*this, name, version, numberOfElements, sizeOfElement, commitInterval, myResult);
+}
+
+void framRing::setCommitInterval(uint16_t commitInterval)
+{
+  _commitInterval = commitInterval > 0 ? commitInterval : 1;
+  _slotSize = _sizeOfElement + (isSequenced() ? sizeof(uint32_t) : 0);
+  _uncommitted = 0;
+  _pointers.head = 0;
+  _pointers.count = 0;
+  _pointers.sequence = 1;
+}
+
+bool framRing::isSequenced()
+{
+  return _commitInterval > 1;
+}
+
+// Locates a named ring the first time it is used. An unnamed ring
+// must end below the named partitions.
+bool framRing::ready()
+{
+  if (_name == NULL)
+  {
+    if (_startAddress + sizeof(ringPointers) + _numberOfElements * _slotSize > myNode._partitionsAddress)
+    {
+      myResult = framBadFinishAddress;
+      return false;
+    }
+    return !_unread;
+  }
+  if (!_located)
+  {
+    bool created;
+    // The slot size identifies the layout
+    _located = myNode.findPartition(_name, FRAM_PARTITION_RING, _numberOfElements, _slotSize,
+      _version, sizeof(ringPointers) + _numberOfElements * _slotSize, _startAddress, created);
+    if (_located && created)
+    {
+      // Start new space empty
+      _pointers.head = 0;
+      _pointers.count = 0;
+      _pointers.sequence = 1;
+      savePointers();
+    }
+  }
+  return _located && !_unread;
+}
+
+void framRing::initialize()
+{
+  TRACE_API(myNode, TRACE_FRAM_RING);
+  _unread = false;
+  if (!ready())
+  {
+    return;
+  }
+  if (!myNode.readFRAM(_startAddress, sizeof(ringPointers), (uint8_t*)&_pointers))
+  {
+    // Leave the ring in Fram alone until initialize() can read it
+    _unread = true;
+    _pointers.count = 0;
+    myResult = framBadResponse;
+    return;
+  }
+  // Start again if the saved pointers are not valid - e.g. a new fram or
+  // a ring saved by an earlier library or with other slots
+  if (_pointers.magic != FRAM_RING_MAGIC || _pointers.slotSize != _slotSize ||
+      _pointers.head >= _numberOfElements || _pointers.count > _numberOfElements)
+  {
+    _pointers.head = 0;
+    _pointers.count = 0;
+    _pointers.sequence = 1;
+    savePointers();
+  }
+  if (isSequenced())
+  {
+    // Sequence 0 is never used so zeroed slots never match
+    if (_pointers.sequence == 0)
+    {
+      _pointers.sequence = 1;
+    }
+    recover();
+    if (!_registered)
+    {
+      // Add to the rings committed by IoTNode::flush()
+      _nextLazy = myNode._lazyRings;
+      myNode._lazyRings = this;
+      _registered = true;
+    }
+  }
+}
+
+// Finds the elements pushed after the last commit. The slot after the
+// newest committed element holds the next sequence number if it was
+// written before the power was lost, and so on until the first mismatch.
+void framRing::recover()
+{
+  uint32_t recovered = 0;
+  while (recovered < _numberOfElements)
+  {
+    uint32_t slot = (_pointers.head + _pointers.count) % _numberOfElements;
+    uint32_t sequence = 0;
+    if (!myNode.readFRAM(slotAddress(slot), sizeof(sequence), (uint8_t*)&sequence))
+    {
+      myResult = framBadResponse;
+      break;
+    }
+    if (sequence != _pointers.sequence + _pointers.count)
+    {
+      break;
+    }
+    if (_pointers.count == _numberOfElements)
+    {
+      // Overwrote the oldest element
+      _pointers.head = (_pointers.head + 1) % _numberOfElements;
+      ++_pointers.sequence;
+    }
+    else
+    {
+      ++_pointers.count;
+    }
+    ++recovered;
+  }
+  if (recovered > 0)
+  {
+    savePointers();
+  }
+}
+
+void framRing::savePointers()
+{
+  TRACE_API(myNode, TRACE_FRAM_RING);
+  _pointers.magic = FRAM_RING_MAGIC;
+  _pointers.slotSize = _slotSize;
+  if (myNode.writeFRAM(_startAddress, sizeof(ringPointers), (uint8_t*)&_pointers))
+  {
+    _uncommitted = 0;
+  }
+  else
+  {
+    myResult = framBadResponse;
+  }
+}
+
+// Saves the pointers after commitInterval operations
+void framRing::changedPointers()
+{
+  if (++_uncommitted >= _commitInterval)
+  {
+    savePointers();
+  }
+}
+
+void framRing::commit()
+{
+  if (_located && !_unread && _uncommitted > 0)
+  {
+    savePointers();
+  }
+}
+
+uint32_t framRing::slotAddress(uint32_t slot)
+{
+  return _startAddress + sizeof(ringPointers) + slot * _slotSize;
+}
+
+// Reads consecutive slots as one transfer, or two if the run wraps
+bool framRing::readSlots(uint32_t slot, uint32_t numberOfElements, byte *buffer)
+{
+  TRACE_API(myNode, TRACE_FRAM_RING);
+  uint32_t firstRun = _numberOfElements - slot;
+  if (firstRun > numberOfElements)
+  {
+    firstRun = numberOfElements;
+  }
+  bool ok = readRun(slot, firstRun, buffer);
+  if (ok && numberOfElements > firstRun)
+  {
+    ok = readRun(0, numberOfElements - firstRun, buffer + firstRun * _sizeOfElement);
+  }
+  if (!ok)
+  {
+    myResult = framBadResponse;
+  }
+  return ok;
+}
+
+// Writes consecutive slots as one transfer, or two if the run wraps
+// sequence is the sequence number of the first element
+bool framRing::writeSlots(uint32_t slot, uint32_t numberOfElements, byte *buffer, uint32_t sequence)
+{
+  TRACE_API(myNode, TRACE_FRAM_RING);
+  uint32_t firstRun = _numberOfElements - slot;
+  if (firstRun > numberOfElements)
+  {
+    firstRun = numberOfElements;
+  }
+  bool ok = writeRun(slot, firstRun, buffer, sequence);
+  if (ok && numberOfElements > firstRun)
+  {
+    ok = writeRun(0, numberOfElements - firstRun, buffer + firstRun * _sizeOfElement, sequence + firstRun);
+  }
+  if (!ok)
+  {
+    myResult = framBadResponse;
+  }
+  return ok;
+}
+
+// Reads slots that do not wrap
+// Sequenced slots are read through a staging buffer to drop the sequence numbers
+bool framRing::readRun(uint32_t slot, uint32_t numberOfElements, byte *buffer)
+{
+  if (!isSequenced())
+  {
+    return myNode.readFRAM(slotAddress(slot), numberOfElements * _sizeOfElement, buffer);
+  }
+  byte stage[FRAM_RING_STAGE_SIZE];
+  uint32_t perStage = sizeof(stage) / _slotSize;
+  while (numberOfElements > 0)
+  {
+    if (perStage == 0)
+    {
+      // Slot larger than the staging buffer
+      if (!myNode.readFRAM(slotAddress(slot) + sizeof(uint32_t), _sizeOfElement, buffer))
+      {
+        return false;
+      }
+      ++slot;
+      buffer += _sizeOfElement;
+      --numberOfElements;
+      continue;
+    }
+    uint32_t count = numberOfElements < perStage ? numberOfElements : perStage;
+    if (!myNode.readFRAM(slotAddress(slot), count * _slotSize, stage))
+    {
       return false;
     }
-
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      memcpy(buffer, stage + i * _slotSize + sizeof(uint32_t), _sizeOfElement);
+      buffer += _sizeOfElement;
+    }
+    slot += count;
+    numberOfElements -= count;
   }
+  return true;
 }
 
+// Writes slots that do not wrap
+// Sequenced slots are written through a staging buffer with their sequence numbers
+bool framRing::writeRun(uint32_t slot, uint32_t numberOfElements, byte *buffer, uint32_t sequence)
+{
+  if (!isSequenced())
+  {
+    return myNode.writeFRAM(slotAddress(slot), numberOfElements * _sizeOfElement, buffer);
+  }
+  byte stage[FRAM_RING_STAGE_SIZE];
+  uint32_t perStage = sizeof(stage) / _slotSize;
+  while (numberOfElements > 0)
+  {
+    if (perStage == 0)
+    {
+      // Slot larger than the staging buffer - element first so that a
+      // torn write leaves the old sequence number
+      if (!myNode.writeFRAM(slotAddress(slot) + sizeof(uint32_t), _sizeOfElement, buffer) ||
+          !myNode.writeFRAM(slotAddress(slot), sizeof(uint32_t), (uint8_t*)&sequence))
+      {
+        return false;
+      }
+      ++slot;
+      ++sequence;
+      buffer += _sizeOfElement;
+      --numberOfElements;
+      continue;
+    }
+    // The elements go first with sequence numbers that recover() does not
+    // accept and then the sequence numbers one at a time. writeFRAM splits
+    // the staged slots into several transfers so a torn write must not
+    // leave a new sequence number in front of old data.
+    uint32_t count = numberOfElements < perStage ? numberOfElements : perStage;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      uint32_t invalid = ~(sequence + i);
+      memcpy(stage + i * _slotSize, &invalid, sizeof(uint32_t));
+      memcpy(stage + i * _slotSize + sizeof(uint32_t), buffer, _sizeOfElement);
+      buffer += _sizeOfElement;
+    }
+    if (!myNode.writeFRAM(slotAddress(slot), count * _slotSize, stage))
+    {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      if (!myNode.writeFRAM(slotAddress(slot + i), sizeof(uint32_t), (uint8_t*)&sequence))
+      {
+        return false;
+      }
+      ++sequence;
+    }
+    slot += count;
+    numberOfElements -= count;
+  }
+  return true;
+}
 
-// Private
+// Pop first element by default
+bool framRing::pop(byte *buffer)
+{
+  return popN(buffer, 1) == 1;
+}
 
-void IoTNode::array_to_string(byte array[], unsigned int len, char buffer[])
+bool framRing::popLast(byte *buffer)
 {
-    for (unsigned int i = 0; i < len; i++)
+  if (!ready() || _pointers.count == 0)
+  {
+    return false;
+  }
+  uint32_t last = (_pointers.head + _pointers.count - 1) % _numberOfElements;
+  if (!readSlots(last, 1, buffer))
+  {
+    return false;
+  }
+  if (isSequenced())
+  {
+    // Spoil the sequence number so recover() does not take the element back
+    uint32_t invalid = ~(_pointers.sequence + _pointers.count - 1);
+    if (!myNode.writeFRAM(slotAddress(last), sizeof(invalid), (uint8_t*)&invalid))
     {
-        byte nib1 = (array[i] >> 4) & 0x0F;
-        byte nib2 = (array[i] >> 0) & 0x0F;
-        buffer[i*2+0] = nib1  < 0xA ? '0' + nib1  : 'A' + nib1  - 0xA;
-        buffer[i*2+1] = nib2  < 0xA ? '0' + nib2  : 'A' + nib2  - 0xA;
+      myResult = framBadResponse;
+      return false;
     }
-    buffer[len*2] = '\0';
+  }
+  --_pointers.count;
+  changedPointers();
+  return true;
 }
 
-void IoTNode::writeFRAM(uint32_t startaddress, uint8_t numberOfBytes, uint8_t *buffer)
+bool framRing::peekFirst(byte *buffer)
+{
+  return peekN(buffer, 1) == 1;
+}
+
+bool framRing::peekLast(byte *buffer)
 {
-  	// Write in 32 byte blocks due to wire limit
-	  const uint8_t blockSize = 30;
-	  byte* buf = buffer;
-	  uint32_t address = startaddress;
+  if (!ready() || _pointers.count == 0)
+  {
+    return false;
+  }
+  uint32_t last = (_pointers.head + _pointers.count - 1) % _numberOfElements;
+  return readSlots(last, 1, buffer);
+}
 
-	  while (numberOfBytes >= blockSize)
-	  {
-			myFram._writeMemory(address, blockSize, buf);
-		  address += blockSize;
-			buf += blockSize;
-		  numberOfBytes -= blockSize;
-	  }
-	  if (numberOfBytes > 0)
-	  {
-	    myFram._writeMemory(address, numberOfBytes, buf);
-	  }
+// Circular buffer overwrites when full!
+void framRing::push(byte *buffer)
+{
+  pushN(buffer, 1);
 }
 
-void IoTNode::readFRAM(uint32_t startaddress, uint8_t numberOfBytes, uint8_t *buffer)
+// Circular buffer overwrites when full!
+uint32_t framRing::pushN(byte *buffer, uint32_t numberOfElements)
 {
-  // Read in 30 byte blocks due to wire requestFrom() limit
-  const uint8_t blockSize = 30;
-  byte* buf = buffer;
-  uint32_t address = startaddress;
+  if (!ready() || numberOfElements == 0 || _numberOfElements == 0)
+  {
+    return 0;
+  }
+  // Only the newest elements fit
+  uint32_t skipped = 0;
+  if (numberOfElements > _numberOfElements)
+  {
+    skipped = numberOfElements - _numberOfElements;
+    buffer += skipped * _sizeOfElement;
+    numberOfElements = _numberOfElements;
+  }
+  uint32_t slot = (_pointers.head + _pointers.count + skipped) % _numberOfElements;
+  if (!writeSlots(slot, numberOfElements, buffer, _pointers.sequence + _pointers.count + skipped))
+  {
+    return 0;
+  }
 
-  while (numberOfBytes >= blockSize)
+  uint32_t total = _pointers.count + skipped + numberOfElements;
+  if (total > _numberOfElements)
+  {
+    // Overwrote the oldest elements
+    _pointers.head = (_pointers.head + total - _numberOfElements) % _numberOfElements;
+    _pointers.sequence += total - _numberOfElements;
+    _pointers.count = _numberOfElements;
+  }
+  else
   {
-	myFram._readMemory(address, blockSize, buf);
-	  address += blockSize;
-		buf += blockSize;
-	  numberOfBytes -= blockSize;
+    _pointers.count = total;
   }
-  if (numberOfBytes > 0)
+  if (skipped > 0)
   {
-    myFram._readMemory(address, numberOfBytes, buf);
+    // Recovery cannot follow a run that skipped slots
+    savePointers();
   }
+  else
+  {
+    changedPointers();
+  }
+  return numberOfElements;
 }
 
-//////////////////
+uint32_t framRing::popN(byte *buffer, uint32_t numberOfElements)
+{
+  uint32_t popped = peekN(buffer, numberOfElements);
+  if (popped > 0)
+  {
+    _pointers.head = (_pointers.head + popped) % _numberOfElements;
+    _pointers.sequence += popped;
+    _pointers.count -= popped;
+    changedPointers();
+  }
+  return popped;
+}
 
-// Fram Array Constructor
-framArray::framArray(FramI2C& fram, uint32_t numberOfElements, byte sizeOfElement, framResult& result):
-  _numberOfElements(numberOfElements), _sizeOfElement(sizeOfElement), myFram(fram), myResult(result),
-  myArray(fram, _numberOfElements, _sizeOfElement, result)
+uint32_t framRing::peekN(byte *buffer, uint32_t numberOfElements)
 {
+  return peekAt(0, buffer, numberOfElements);
+}
 
+uint32_t framRing::peekAt(uint32_t index, byte *buffer, uint32_t numberOfElements)
+{
+  if (!ready() || index >= _pointers.count)
+  {
+    return 0;
+  }
+  if (numberOfElements > _pointers.count - index)
+  {
+    numberOfElements = _pointers.count - index;
+  }
+  if (numberOfElements > 0 &&
+      !readSlots((_pointers.head + index) % _numberOfElements, numberOfElements, buffer))
+  {
+    return 0;
+  }
+  return numberOfElements;
 }
 
-framArray IoTNode::makeFramArray(uint32_t numberOfElements, byte sizeOfElement)
+void framRing::setTimestampOffset(uint16_t offset)
 {
-  return framArray(myFram, numberOfElements,sizeOfElement, myResult);
+  _timestampOffset = offset;
 }
 
-bool framArray::write(uint32_t index, byte *buffer)
+// Binary search over the elements in ring order reading only the times
+uint32_t framRing::findTime(uint32_t unixTime)
 {
-  framResult checkResult = framUnknownError;
-  myArray.writeElement(index, buffer, checkResult);
-  if (checkResult==framOK)
+  TRACE_API(myNode, TRACE_FRAM_RING);
+  if (!ready() || _timestampOffset + sizeof(uint32_t) > _sizeOfElement)
   {
-    return true;
+    return _pointers.count;
   }
-  else
+  uint32_t dataOffset = _slotSize - _sizeOfElement + _timestampOffset;
+  uint32_t low = 0;
+  uint32_t high = _pointers.count;
+  while (low < high)
   {
-    return false;
+    uint32_t middle = low + (high - low) / 2;
+    uint32_t slot = (_pointers.head + middle) % _numberOfElements;
+    uint32_t time = 0;
+    if (!myNode.readFRAM(slotAddress(slot) + dataOffset, sizeof(time), (uint8_t*)&time))
+    {
+      myResult = framBadResponse;
+      return _pointers.count;
+    }
+    if (time < unixTime)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
   }
-  
+  return low;
 }
 
-bool framArray::read(uint32_t index, byte *buffer)
+void framRing::clearArray()
 {
-  framResult checkResult = framUnknownError;
-  myArray.readElement(index, buffer, checkResult);
-  if (checkResult==framOK)
+  TRACE_API(myNode, TRACE_FRAM_RING);
+  if (!ready())
   {
-    return true;
+    return;
   }
-  else
+  byte zeros[32] = {0};
+  uint32_t address = slotAddress(0);
+  uint32_t remaining = _numberOfElements * _slotSize;
+  while (remaining > 0)
   {
-    return false;
+    uint32_t size = remaining < sizeof(zeros) ? remaining : sizeof(zeros);
+    myNode.writeFRAM(address, size, zeros);
+    address += size;
+    remaining -= size;
   }
-  
+  _pointers.head = 0;
+  _pointers.count = 0;
+  savePointers();
 }
 
+bool framRing::isEmpty()
+{
+  return _pointers.count == 0;
+}
 
-//////////////////
+bool framRing::isFull()
+{
+  return _pointers.count == _numberOfElements;
+}
 
-// Fram Ring Array Constructor
-framRing::framRing(FramI2C& fram, uint32_t numberOfElements, byte sizeOfElement, framResult& result):
-  _numberOfElements(numberOfElements), _sizeOfElement(sizeOfElement), myFram(fram), myResult(result),
-  myRing(fram, _numberOfElements, _sizeOfElement, result)
+uint32_t framRing::count()
+{
+  return _pointers.count;
+}
+
+// Zigzag maps small negative and positive numbers to small unsigned numbers
+static byte writeVarint(int32_t value, byte *buffer)
+{
+  uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+  byte length = 0;
+  while (zigzag >= 0x80)
+  {
+    buffer[length++] = (byte)(zigzag | 0x80);
+    zigzag >>= 7;
+  }
+  buffer[length++] = (byte)zigzag;
+  return length;
+}
+
+static byte readVarint(const byte *buffer, byte available, int32_t& value)
 {
+  uint32_t zigzag = 0;
+  byte length = 0;
+  while (length < available && length < FRAM_PACKED_VARINT_SIZE)
+  {
+    byte b = buffer[length];
+    zigzag |= (uint32_t)(b & 0x7F) << (7 * length);
+    length++;
+    if ((b & 0x80) == 0)
+    {
+      value = (int32_t)((zigzag >> 1) ^ (0 - (zigzag & 1)));
+      return length;
+    }
+  }
+  return 0;
+}
 
+framPackedRing::framPackedRing(framRing& ring, byte channels, uint32_t deltaChannels):
+  myRing(ring), _channels(channels), _deltaChannels(deltaChannels), _blockSize(ring._sizeOfElement),
+  _pushUsed(0), _pushSaved(false), _pushSequence(0), _resumed(false),
+  _popUsed(0), _popRemaining(0), _popSaved(false), _popSequence(0), _popTaken(false)
+{
+  // Byte 0 of a block is the number of records
+  _valid = channels > 0 && channels <= FRAM_PACKED_MAX_CHANNELS &&
+           _blockSize <= FRAM_PACKED_MAX_BLOCK_SIZE &&
+           _blockSize >= 1 + (uint32_t)channels * FRAM_PACKED_VARINT_SIZE;
+  // Add to the packed rings flushed by IoTNode::flush()
+  _nextPacked = myRing.myNode._packedRings;
+  myRing.myNode._packedRings = this;
 }
 
-framRing IoTNode::makeFramRing(uint32_t numberOfElements, byte sizeOfElement)
+framPackedRing::framPackedRing(const framPackedRing& other):
+  myRing(other.myRing), _channels(other._channels), _deltaChannels(other._deltaChannels),
+  _blockSize(other._blockSize), _valid(other._valid), _pushUsed(other._pushUsed),
+  _pushSaved(other._pushSaved), _pushSequence(other._pushSequence), _resumed(other._resumed),
+  _popUsed(other._popUsed), _popRemaining(other._popRemaining), _popSaved(other._popSaved),
+  _popSequence(other._popSequence), _popTaken(other._popTaken)
 {
-  return framRing(myFram, numberOfElements,sizeOfElement, myResult);
+  memcpy(_pushBlock, other._pushBlock, sizeof(_pushBlock));
+  memcpy(_pushPrevious, other._pushPrevious, sizeof(_pushPrevious));
+  memcpy(_popBlock, other._popBlock, sizeof(_popBlock));
+  memcpy(_popPrevious, other._popPrevious, sizeof(_popPrevious));
+  _nextPacked = myRing.myNode._packedRings;
+  myRing.myNode._packedRings = this;
 }
 
-void framRing::initialize()
+// Leaves the packed rings flushed by IoTNode::flush()
+framPackedRing::~framPackedRing()
 {
-  myRing.initialize();
+  for (framPackedRing **ring = &myRing.myNode._packedRings; *ring != NULL; ring = &(*ring)->_nextPacked)
+  {
+    if (*ring == this)
+    {
+      *ring = _nextPacked;
+      break;
+    }
+  }
 }
 
+// A record in full when previous is NULL, otherwise with the delta
+// channels as differences from previous
+byte framPackedRing::encodeRecord(const int32_t *values, const int32_t *previous, byte *buffer)
+{
+  byte length = 0;
+  for (byte i = 0; i < _channels; i++)
+  {
+    int32_t value = values[i];
+    if (previous != NULL && (_deltaChannels & (1UL << i)))
+    {
+      // Wraps rather than overflows so any two values have a difference
+      value = (int32_t)((uint32_t)values[i] - (uint32_t)previous[i]);
+    }
+    length += writeVarint(value, buffer + length);
+  }
+  return length;
+}
 
-// Pop first element by default
-bool framRing::pop(byte *buffer)
+// Returns the length of the record, 0 if it is damaged
+byte framPackedRing::decodeRecord(const byte *buffer, byte available, const int32_t *previous, int32_t *values)
 {
-  return myRing.pop(buffer);
+  byte length = 0;
+  for (byte i = 0; i < _channels; i++)
+  {
+    int32_t value = 0;
+    byte used = readVarint(buffer + length, available - length, value);
+    if (used == 0)
+    {
+      return 0;
+    }
+    length += used;
+    if (previous != NULL && (_deltaChannels & (1UL << i)))
+    {
+      value = (int32_t)((uint32_t)previous[i] + (uint32_t)value);
+    }
+    values[i] = value;
+  }
+  return length;
 }
 
-bool framRing::popLast(byte *buffer)
+// The ring element with the sequence number is still the newest or oldest
+bool framPackedRing::isNewest(uint32_t sequence)
 {
-  return myRing.popLastElement(buffer);
+  return myRing._pointers.count > 0 && myRing._pointers.sequence + myRing._pointers.count - 1 == sequence;
 }
 
-bool framRing::peekFirst(byte *buffer)
+bool framPackedRing::isOldest(uint32_t sequence)
 {
-  return myRing.peekFirstElement(buffer);
+  return myRing._pointers.count > 0 && myRing._pointers.sequence == sequence;
 }
 
-bool framRing::peekLast(byte *buffer)
+bool framPackedRing::push(const int32_t *values)
 {
-  return myRing.peekLastElement(buffer);
+  if (!_valid)
+  {
+    return false;
+  }
+  if (!_resumed)
+  {
+    resume();
+  }
+  byte record[FRAM_PACKED_MAX_CHANNELS * FRAM_PACKED_VARINT_SIZE];
+  byte length = encodeRecord(values, _pushUsed == 0 ? NULL : _pushPrevious, record);
+  if (_pushUsed > 0 && _pushUsed + length > _blockSize)
+  {
+    if (!saveBlock(false))
+    {
+      return false;
+    }
+    length = encodeRecord(values, NULL, record);
+  }
+  if (_pushUsed == 0)
+  {
+    _pushBlock[0] = 0;
+    _pushUsed = 1;
+  }
+  memcpy(_pushBlock + _pushUsed, record, length);
+  _pushUsed += length;
+  _pushBlock[0]++;
+  memcpy(_pushPrevious, values, _channels * sizeof(int32_t));
+  return true;
 }
 
-// Circular buffer overwrites when full!
-void framRing::push(byte *buffer)
+// Saves the block being built as the newest element of the ring. An open
+// block is rewritten in place by the next save and is picked up again by
+// resume() after a restart. A closed block is full.
+bool framPackedRing::saveBlock(bool open)
 {
-  myRing.push(buffer);
+  if (_pushUsed == 0)
+  {
+    return true;
+  }
+  byte count = _pushBlock[0];
+  memset(_pushBlock + _pushUsed, 0, _blockSize - _pushUsed);
+  _pushBlock[0] = open ? (count | FRAM_PACKED_OPEN) : count;
+  bool ok;
+  if (_pushSaved && isNewest(_pushSequence))
+  {
+    uint32_t newest = (myRing._pointers.head + myRing._pointers.count - 1) % myRing._numberOfElements;
+    ok = myRing.writeSlots(newest, 1, _pushBlock, _pushSequence);
+  }
+  else
+  {
+    ok = myRing.pushN(_pushBlock, 1) == 1;
+    _pushSequence = myRing._pointers.sequence + myRing._pointers.count - 1;
+  }
+  _pushBlock[0] = count;
+  if (open)
+  {
+    _pushSaved = ok;
+  }
+  else if (ok)
+  {
+    _pushUsed = 0;
+    _pushSaved = false;
+  }
+  return ok;
 }
 
-void framRing::clearArray()
+// Carries on filling the newest block after a restart if it was saved open
+void framPackedRing::resume()
 {
-  myRing.clearArray();
+  _resumed = true;
+  if (_pushUsed > 0 || myRing.count() == 0)
+  {
+    return;
+  }
+  uint32_t newest = myRing._pointers.sequence + myRing._pointers.count - 1;
+  if (_popSaved && _popSequence == newest)
+  {
+    // Being popped
+    return;
+  }
+  byte block[FRAM_PACKED_MAX_BLOCK_SIZE];
+  if (!myRing.peekLast(block) || (block[0] & FRAM_PACKED_OPEN) == 0)
+  {
+    return;
+  }
+  // Find the end of the block and its last record
+  byte count = block[0] & ~FRAM_PACKED_OPEN;
+  byte used = 1;
+  int32_t values[FRAM_PACKED_MAX_CHANNELS];
+  for (byte i = 0; i < count; i++)
+  {
+    byte length = decodeRecord(block + used, _blockSize - used, i == 0 ? NULL : values, values);
+    if (length == 0)
+    {
+      // A damaged block - start a new one
+      return;
+    }
+    used += length;
+  }
+  if (count == 0)
+  {
+    return;
+  }
+  memcpy(_pushBlock, block, _blockSize);
+  _pushBlock[0] = count;
+  _pushUsed = used;
+  memcpy(_pushPrevious, values, _channels * sizeof(int32_t));
+  _pushSaved = true;
+  _pushSequence = newest;
 }
 
-bool framRing::isEmpty()
+void framPackedRing::flush()
 {
-  return myRing.isEmpty();
+  if (!_valid)
+  {
+    return;
+  }
+  saveBlock(true);
+  saveReadBlock();
 }
 
-bool framRing::isFull()
+// Replaces the block being popped with its records that are left so that
+// the popped records do not return after a restart
+void framPackedRing::saveReadBlock()
+{
+  if (!_popSaved || !_popTaken || _popRemaining == 0 || !isOldest(_popSequence))
+  {
+    return;
+  }
+  byte block[FRAM_PACKED_MAX_BLOCK_SIZE] = {0};
+  byte record[FRAM_PACKED_MAX_CHANNELS * FRAM_PACKED_VARINT_SIZE];
+  int32_t previous[FRAM_PACKED_MAX_CHANNELS];
+  int32_t values[FRAM_PACKED_MAX_CHANNELS];
+  memcpy(previous, _popPrevious, sizeof(previous));
+  byte used = _popUsed;
+  byte saved = 1;
+  for (byte i = 0; i < _popRemaining; i++)
+  {
+    byte length = decodeRecord(_popBlock + used, _blockSize - used, previous, values);
+    if (length == 0)
+    {
+      return;
+    }
+    used += length;
+    // The first record is saved in full so may not fit - the popped
+    // records then return after a restart
+    length = encodeRecord(values, i == 0 ? NULL : previous, record);
+    if (saved + length > _blockSize)
+    {
+      return;
+    }
+    memcpy(block + saved, record, length);
+    saved += length;
+    memcpy(previous, values, sizeof(previous));
+  }
+  block[0] = _popRemaining | (_popBlock[0] & FRAM_PACKED_OPEN);
+  if (myRing.writeSlots(myRing._pointers.head, 1, block, _popSequence))
+  {
+    memcpy(_popBlock, block, _blockSize);
+    _popUsed = 1;
+    _popTaken = false;
+  }
+}
+
+// Reads the oldest block. It stays on the ring until all its records are
+// popped. A block that is only being built, or that is newer in RAM than
+// on the ring, is taken from RAM.
+bool framPackedRing::loadBlock()
+{
+  bool building = _pushUsed > 0 &&
+    (myRing.isEmpty() || (myRing.count() == 1 && _pushSaved && isNewest(_pushSequence)));
+  if (building)
+  {
+    if (!myRing.isEmpty() && !myRing.pop(_popBlock))
+    {
+      return false;
+    }
+    memcpy(_popBlock, _pushBlock, _blockSize);
+    _popRemaining = _pushBlock[0];
+    _popSaved = false;
+    _pushUsed = 0;
+    _pushSaved = false;
+  }
+  else
+  {
+    if (!myRing.peekFirst(_popBlock))
+    {
+      return false;
+    }
+    _popRemaining = _popBlock[0] & ~FRAM_PACKED_OPEN;
+    _popSaved = true;
+    _popSequence = myRing._pointers.sequence;
+    if (_popRemaining == 0)
+    {
+      // Nothing to pop - drop it
+      return finishBlock();
+    }
+  }
+  _popUsed = 1;
+  _popTaken = false;
+  return true;
+}
+
+// Removes the block from the ring once all its records are popped
+bool framPackedRing::finishBlock()
+{
+  bool ok = true;
+  if (_popSaved && isOldest(_popSequence))
+  {
+    ok = myRing.pop(_popBlock);
+  }
+  _popSaved = false;
+  _popTaken = false;
+  return ok;
+}
+
+bool framPackedRing::pop(int32_t *values)
 {
-  return myRing.isFull();
+  if (!_valid)
+  {
+    return false;
+  }
+  while (_popRemaining == 0)
+  {
+    if (!loadBlock())
+    {
+      return false;
+    }
+  }
+  byte length = decodeRecord(_popBlock + _popUsed, _blockSize - _popUsed,
+    _popUsed == 1 ? NULL : _popPrevious, values);
+  if (length == 0)
+  {
+    // A damaged block - skip the rest of it
+    _popRemaining = 0;
+    finishBlock();
+    return pop(values);
+  }
+  _popUsed += length;
+  _popRemaining--;
+  memcpy(_popPrevious, values, _channels * sizeof(int32_t));
+  if (_popRemaining == 0)
+  {
+    finishBlock();
+  }
+  else
+  {
+    _popTaken = true;
+  }
+  return true;
 }
 
+bool framPackedRing::isEmpty()
+{
+  return _popRemaining == 0 && _pushUsed == 0 && myRing.isEmpty();
+}
 
- 
+void framPackedRing::initialize()
+{
+  myRing.clearArray();
+  _pushUsed = 0;
+  _pushSaved = false;
+  _resumed = true;
+  _popUsed = 0;
+  _popRemaining = 0;
+  _popSaved = false;
+  _popTaken = false;
+}
@@ -9,7 +9,6 @@
 #endif //end of #ifdef PARTICLE
 
 
-#include <Adafruit_MCP23017.h>
 #include "MCP7941x.h"
 #include "FramI2C.h"
 #include <SdFat.h>
@@ -31,129 +30,18 @@
 // #define PLATFORM_XENON						           14
 // #define PLATFORM_NEWHAL                     60000
 
-//Photon
-#if PLATFORM_ID==6 || PLATFORM_ID==8
-#define N_SDA0 SDA
-#define N_SCL0 SCL
-#define N_D0 D2
-#define GIOA D2
-#define N_D1 D3
-#define GIOB D3
-#define N_D2 D4
-#define GIOC D4
-#define N_D3 D5
-#define GIOD D5
-#define N_D4 D6
-#define GIOE D6
-#define N_D5 D7
-#define GIOF D7
-#define N_D6 DAC
-#define GIOG DAC
-#define N_A2 A0
-#define N_A3 A1
-#define N_SCK SCK
-#define N_MOSI MOSI
-#define N_MISO MISO
-#define N_RX0 RX
-#define N_TX0 TX
-#endif
-
-//Electron
-#if PLATFORM_ID==10
-#define N_SDA0 SDA
-#define N_SCL0 SCL
-#define N_D0 D2
-#define GIOA D2
-#define N_D1 D3
-#define GIOB D3
-#define N_D2 D4
-#define GIOC D4
-#define N_D3 D5
-#define GIOD D5
-#define N_D4 D6
-#define GIOE D6
-#define N_D5 D7
-#define GIOF D7
-#define N_D6 DAC
-#define GIOG DAC
-#define N_A0 B4
-#define N_A1 B5
-#define N_A2 A0
-#define N_A3 A1
-#define N_SCK SCK
-#define N_MOSI MOSI
-#define N_MISO MISO
-#define N_RX0 RX
-#define N_TX0 TX
-#define N_RX1 UART4_RX
-#define N_TX1 UART4_TX
-#define CANRX CAN1_RX
-#define CANTX CAN1_TX
-#endif
-
-//Mesh
-#if PLATFORM_ID==12 || PLATFORM_ID==13 || PLATFORM_ID==14
-#define N_SDA0 SDA
-#define N_SCL0 SCL
-#define N_D0 D2
-#define GIOA D2
-#define N_D1 D3
-#define GIOB D3
-#define N_D2 D4
-#define GIOC D4
-#define N_D3 D5
-#define GIOD D5
-#define N_D4 D6
-#define GIOE D6
-#define N_D5 D7
-#define GIOF D7
-#define N_D6 D8
-#define GIOG D8
-#define N_A0 A0
-#define N_A1 A1
-#define N_A2 A2
-#define N_A3 A3
-#define N_A4 A4
-#define N_A5 A5
-#define N_SCK SCK
-#define N_MOSI MOSI
-#define N_MISO MISO
-#define N_RX0 RX
-#define N_TX0 TX
-#endif
-
-#define ARTEMIS
-
-#ifdef ARTEMIS
-  #define N_SDA0 D16
-  #define N_SCL0 D17
-  #define SDA D16
-  #define SCL D17
-  #define N_D0 D3
-  #define GIOA D3
-  #define N_D1 D4
-  #define GIOB D4
-  #define N_D2 D5
-  #define GIOC D5
-  #define N_D3 D6
-  #define GIOD D6
-  #define N_D4 D7
-  #define GIOE D7
-  #define N_D5 D8
-  #define GIOF D8
-  #define N_D6 D9
-  #define GIOG D9
-  #define N_A0 A0
-  #define N_A1 A1
-  #define N_A2 A2
-  #define N_A3 A3
-  #define N_A4 A4
-  #define N_A5 A5
-  #define N_SCK SCK
-  #define N_MOSI MOSI
-  #define N_MISO MISO
-  #define N_RX0 RX
-  #define N_TX0 TX
+/**
+ * @brief Size of the Wire (I2C) transmit and receive buffers.
+ * Sets the size of FRAM transfers. Taken from the platform Wire library
+ * by boardTraits unless set as a compiler flag for the whole build - e.g.
+ * when a Gen3 application enlarges the Wire buffer with acquireWireBuffer().
+ * A #define in the sketch does not reach IoTNode.cpp.
+ * 
+ */
+#ifdef IOTNODE_I2C_BUFFER_SIZE
+  #define IOTNODE_WIRE_BUFFER(platformSize) IOTNODE_I2C_BUFFER_SIZE
+#else
+  #define IOTNODE_WIRE_BUFFER(platformSize) platformSize
 #endif
 
 /**
@@ -168,6 +56,182 @@ enum powerName {INT5V, INT12V, EXT3V3, EXT5V, EXT12V};
 // See IoT Node schematic
 enum gioName {GIO1=11, GIO2, GIO3};
 
+/**
+ * @brief Power rails fitted to the IoT Node - bit n is powerName n.
+ * Becomes iotNodeBoard::rails so setPower(), powerON() and powerOFF() skip
+ * absent rails and allPowerON() and allPowerOFF() leave their enable pins
+ * alone, i.e. -DIOTNODE_RAILS=0x0C for a v1.1 board with only the EXT3V3
+ * and EXT5V regulators. Only takes effect as a compiler flag for the whole
+ * build as IoTNode.cpp does not see a #define in the sketch.
+ * 
+ */
+#ifndef IOTNODE_RAILS
+  #define IOTNODE_RAILS ((1 << INT5V) | (1 << INT12V) | (1 << EXT3V3) | (1 << EXT5V) | (1 << EXT12V))
+#endif
+
+/**
+ * @brief The platforms the IoT Node takes.
+ * 
+ */
+enum boardPlatform {BOARD_PHOTON, BOARD_ELECTRON, BOARD_GEN3, BOARD_ARTEMIS};
+
+/**
+ * @brief Pins and features of the IoT Node for each platform.
+ * All members are constants so pin lookups fold to numbers. Only the traits of the
+ * platform being built are defined as the pins of the others do not exist.
+ * The board for the build is iotNodeBoard and the N_ and GIO pin names
+ * use it, i.e. N_D0 is iotNodeBoard::d0.
+ * 
+ * @tparam Platform the boardPlatform
+ */
+template <boardPlatform Platform>
+struct boardTraits;
+
+#if PLATFORM_ID==6 || PLATFORM_ID==8
+// Photon and P1
+template <>
+struct boardTraits<BOARD_PHOTON>
+{
+#ifdef I2C_BUFFER_LENGTH
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(I2C_BUFFER_LENGTH);
+#else
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(32);
+#endif
+  static constexpr uint8_t rails = IOTNODE_RAILS;
+  static constexpr uint8_t sdMaxClockMHz = 30;
+  static constexpr uint16_t sda = SDA, scl = SCL;
+  static constexpr uint16_t d0 = D2, d1 = D3, d2 = D4, d3 = D5, d4 = D6, d5 = D7, d6 = DAC;
+  static constexpr uint16_t a2 = A0, a3 = A1;
+  static constexpr uint16_t sck = SCK, mosi = MOSI, miso = MISO;
+  static constexpr uint16_t rx0 = RX, tx0 = TX;
+};
+typedef boardTraits<BOARD_PHOTON> iotNodeBoard;
+
+#elif PLATFORM_ID==10
+// Electron
+template <>
+struct boardTraits<BOARD_ELECTRON>
+{
+#ifdef I2C_BUFFER_LENGTH
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(I2C_BUFFER_LENGTH);
+#else
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(32);
+#endif
+  static constexpr uint8_t rails = IOTNODE_RAILS;
+  static constexpr uint8_t sdMaxClockMHz = 30;
+  static constexpr uint16_t sda = SDA, scl = SCL;
+  static constexpr uint16_t d0 = D2, d1 = D3, d2 = D4, d3 = D5, d4 = D6, d5 = D7, d6 = DAC;
+  static constexpr uint16_t a0 = B4, a1 = B5, a2 = A0, a3 = A1;
+  static constexpr uint16_t sck = SCK, mosi = MOSI, miso = MISO;
+  static constexpr uint16_t rx0 = RX, tx0 = TX, rx1 = UART4_RX, tx1 = UART4_TX;
+  static constexpr uint16_t canRx = CAN1_RX, canTx = CAN1_TX;
+};
+typedef boardTraits<BOARD_ELECTRON> iotNodeBoard;
+
+#elif PLATFORM_ID==12 || PLATFORM_ID==13 || PLATFORM_ID==14
+// Argon, Boron and Xenon
+template <>
+struct boardTraits<BOARD_GEN3>
+{
+#ifdef I2C_BUFFER_LENGTH
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(I2C_BUFFER_LENGTH);
+#else
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(32);
+#endif
+  static constexpr uint8_t rails = IOTNODE_RAILS;
+  static constexpr uint8_t sdMaxClockMHz = 32;
+  static constexpr uint16_t sda = SDA, scl = SCL;
+  static constexpr uint16_t d0 = D2, d1 = D3, d2 = D4, d3 = D5, d4 = D6, d5 = D7, d6 = D8;
+  static constexpr uint16_t a0 = A0, a1 = A1, a2 = A2, a3 = A3, a4 = A4, a5 = A5;
+  static constexpr uint16_t sck = SCK, mosi = MOSI, miso = MISO;
+  static constexpr uint16_t rx0 = RX, tx0 = TX;
+};
+typedef boardTraits<BOARD_GEN3> iotNodeBoard;
+
+#else
+// SparkFun Artemis
+template <>
+struct boardTraits<BOARD_ARTEMIS>
+{
+#ifdef AP3_WIRE_RX_BUFFER_LEN
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(AP3_WIRE_RX_BUFFER_LEN);
+#elif defined(BUFFER_LENGTH)
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(BUFFER_LENGTH);
+#else
+  static constexpr uint16_t i2cBufferSize = IOTNODE_WIRE_BUFFER(32);
+#endif
+  static constexpr uint8_t rails = IOTNODE_RAILS;
+  static constexpr uint8_t sdMaxClockMHz = 24;
+  static constexpr uint16_t sda = D16, scl = D17;
+  static constexpr uint16_t d0 = D3, d1 = D4, d2 = D5, d3 = D6, d4 = D7, d5 = D8, d6 = D9;
+  static constexpr uint16_t a0 = A0, a1 = A1, a2 = A2, a3 = A3, a4 = A4, a5 = A5;
+  static constexpr uint16_t sck = SCK, mosi = MOSI, miso = MISO;
+  static constexpr uint16_t rx0 = RX, tx0 = TX;
+};
+typedef boardTraits<BOARD_ARTEMIS> iotNodeBoard;
+#endif
+
+// IoT Node pin names - only the pins of the platform are defined
+#define N_SDA0 (iotNodeBoard::sda)
+#define N_SCL0 (iotNodeBoard::scl)
+#define N_D0 (iotNodeBoard::d0)
+#define GIOA (iotNodeBoard::d0)
+#define N_D1 (iotNodeBoard::d1)
+#define GIOB (iotNodeBoard::d1)
+#define N_D2 (iotNodeBoard::d2)
+#define GIOC (iotNodeBoard::d2)
+#define N_D3 (iotNodeBoard::d3)
+#define GIOD (iotNodeBoard::d3)
+#define N_D4 (iotNodeBoard::d4)
+#define GIOE (iotNodeBoard::d4)
+#define N_D5 (iotNodeBoard::d5)
+#define GIOF (iotNodeBoard::d5)
+#define N_D6 (iotNodeBoard::d6)
+#define GIOG (iotNodeBoard::d6)
+#if PLATFORM_ID!=6 && PLATFORM_ID!=8
+#define N_A0 (iotNodeBoard::a0)
+#define N_A1 (iotNodeBoard::a1)
+#endif
+#define N_A2 (iotNodeBoard::a2)
+#define N_A3 (iotNodeBoard::a3)
+#if PLATFORM_ID!=6 && PLATFORM_ID!=8 && PLATFORM_ID!=10
+#define N_A4 (iotNodeBoard::a4)
+#define N_A5 (iotNodeBoard::a5)
+#endif
+#define N_SCK (iotNodeBoard::sck)
+#define N_MOSI (iotNodeBoard::mosi)
+#define N_MISO (iotNodeBoard::miso)
+#define N_RX0 (iotNodeBoard::rx0)
+#define N_TX0 (iotNodeBoard::tx0)
+#if PLATFORM_ID==10
+#define N_RX1 (iotNodeBoard::rx1)
+#define N_TX1 (iotNodeBoard::tx1)
+#define CANRX (iotNodeBoard::canRx)
+#define CANTX (iotNodeBoard::canTx)
+#endif
+
+/**
+ * @brief The state of a request made with the IoTNode request functions,
+ * i.e. IoTNode::requestWatchdog(). Requests are run by IoTNode::poll().
+ * 
+ */
+enum requestStatus {REQUEST_NONE, REQUEST_PENDING, REQUEST_DONE, REQUEST_FAILED};
+
+/**
+ * @brief Called by IoTNode::poll() when a request finishes.
+ * The request handle is free to reuse after the callback.
+ * 
+ */
+typedef void (*requestCallback)(int handle, requestStatus status, void *context);
+
+/**
+ * @brief Most requests waiting for IoTNode::poll() at one time.
+ * 
+ */
+#define IOTNODE_REQUEST_QUEUE_SIZE 8
+
+class IoTNode;
+
 /**
  * @brief The framArray class is used to create arrays of elements in Fram.
  * The library manages the location of the array in Fram.
@@ -181,8 +245,10 @@ class framArray
   public:
   /**
    * @brief Construct a new fram Array object
+   *
+   * Typically not used directly. @see IoTNode::makeFramArray
    * 
-   * @param fram is the fram instance that is being used - see the FramI2C class
+   * @param node is the IoT Node instance that owns the fram
    * @param numberOfElements is the number of elements in the array
    * @param sizeOfElement is the size of one element in bytes - use sizeof(element)
    * @param result is an enum defining the success:
@@ -200,7 +266,23 @@ class framArray
    * 	framUnknownError = 99
    * };
    */
-  framArray(FramI2C& fram, uint32_t numberOfElements, byte sizeOfElement, framResult& result);
+  framArray(IoTNode& node, uint32_t numberOfElements, byte sizeOfElement, framResult& result);
+
+  /**
+   * @brief Copy a framArray.
+   * A copy of a cached array shares the RAM copy and is also written back
+   * by IoTNode::flush().
+   *
+   * @param other is the framArray to copy
+   */
+  framArray(const framArray& other);
+
+  /**
+   * @brief Stop IoTNode::flush() from writing back the array.
+   * Use flush() first to keep changes to a cached array.
+   * 
+   */
+  ~framArray();
 
   /**
    * @brief Write an element to an array.
@@ -219,13 +301,84 @@ class framArray
    * @return true if the read was successful
    */
   bool read(uint32_t index, byte *buffer);
+
+  /**
+   * @brief Keep a RAM copy of the array so that reads and writes do not use I2C.
+   * The RAM copy is loaded from Fram with one read. Writes change the RAM copy
+   * and the changed elements are written back to Fram by flush().
+   * flush() is also run after flushEveryWrites writes, on a write when
+   * flushEveryMillis has passed since the last flush, and for every cached
+   * array by IoTNode::flush() and IoTNode::switchOffFor().
+   * i.e.
+   * Status statusCache[1];
+   * framarraytest.enableCache((uint8_t*)statusCache, 10);
+   *
+   * @param cache is RAM for numberOfElements * sizeOfElement bytes - must stay valid
+   * @param flushEveryWrites is the number of writes between flushes - 0 for no limit
+   * @param flushEveryMillis is the time in ms between flushes - 0 for no limit
+   */
+  void enableCache(byte *cache, uint16_t flushEveryWrites = 0, uint32_t flushEveryMillis = 0);
+
+  /**
+   * @brief Write the changed elements in the RAM copy to Fram.
+   * The changed elements are written with one sequential transfer.
+   * Does nothing if enableCache() has not been used.
+   *
+   */
+  void flush();
+
+  /**
+   * @brief Write an element in the background. @see IoTNode::poll()
+   * The buffer is read while the request runs so must stay valid and
+   * unchanged until it is done. Cached arrays write the RAM copy at once.
+   *
+   * @param index is the index of the array
+   * @param buffer is a pointer to the element
+   * @param callback is called when the write is done - NULL to check with IoTNode::requestState()
+   * @param context is passed to the callback
+   * @return int the request handle, -1 if the index is out of bounds or the queue is full
+   */
+  int requestWrite(uint32_t index, byte *buffer, requestCallback callback = NULL, void *context = NULL);
+
+  /**
+   * @brief Read an element in the background. @see IoTNode::poll()
+   *
+   * @param index is the index of the array
+   * @param buffer is a pointer to space for the element - must stay valid until done
+   * @param callback is called when the read is done - NULL to check with IoTNode::requestState()
+   * @param context is passed to the callback
+   * @return int the request handle, -1 if the index is out of bounds or the queue is full
+   */
+  int requestRead(uint32_t index, byte *buffer, requestCallback callback = NULL, void *context = NULL);
+
+  protected:
+  // Used by framArrayT for an array at a fixed address
+  framArray(IoTNode& node, uint32_t startAddress, uint32_t numberOfElements, uint32_t sizeOfElement, framResult& result);
   
   private:
+  friend class IoTNode;
+  // Used by IoTNode::makeFramArray for a named array in the partition directory
+  framArray(IoTNode& node, const char *name, uint16_t version, uint32_t numberOfElements, byte sizeOfElement, framResult& result);
+  bool ready();
   uint32_t _numberOfElements;
-  byte _sizeOfElement;
-  FramI2C& myFram;
+  uint32_t _sizeOfElement;
+  IoTNode& myNode;
   framResult& myResult;
-  FramI2CArray myArray;
+  uint32_t _startAddress;
+  // Named arrays are found in the partition directory on first use
+  const char *_name = NULL;
+  uint16_t _version = 0;
+  bool _located = true;
+  // Write-back cache - see enableCache()
+  byte *_cache = NULL;
+  uint32_t _firstChanged = 0;
+  uint32_t _lastChanged = 0;
+  bool _changed = false;
+  uint16_t _writes = 0;
+  uint16_t _flushEveryWrites = 0;
+  uint32_t _flushEveryMillis = 0;
+  uint32_t _lastFlushMillis = 0;
+  framArray *_nextCached = NULL;
 };
 
 /**
@@ -233,6 +386,12 @@ class framArray
  *
  * The framRing keeps track of the
  * ring pointers in Fram so that the ring can be used between power off cycles.
+ * The pointers are stored in a small header in front of the elements.
+ * By default the pointers are saved on every push and pop. With a commit
+ * interval they are saved every commitInterval operations, each element
+ * is saved with a sequence number, and initialize() uses the sequence
+ * numbers to recover elements pushed after the last save. Elements popped
+ * after the last save return after an unexpected power loss.
  */
 class framRing
 {
@@ -243,9 +402,10 @@ class framRing
    *
    * Typically not used directly. @see IotNode::makeFramRing
    *
-   * @param fram is the fram instance that is being used - see the FramI2C class
+   * @param node is the IoT Node instance that owns the fram
    * @param numberOfElements is the number of elements in the array
    * @param sizeOfElement is the size of one element in bytes - use sizeof(element)
+   * @param commitInterval is the number of operations between saves of the ring pointers
    * @param result is an enum defining the result:
    * @code{.cpp}
    * enum framResult
@@ -263,7 +423,23 @@ class framRing
    * };
    * @endcode
    */
-  framRing(FramI2C& fram, uint32_t numberOfElements, byte sizeOfElement, framResult& result);
+  framRing(IoTNode& node, uint32_t numberOfElements, byte sizeOfElement, uint16_t commitInterval, framResult& result);
+
+  /**
+   * @brief Copy a framRing.
+   * A copy of an initialized ring with a commit interval is also committed
+   * by IoTNode::flush().
+   *
+   * @param other is the framRing to copy
+   */
+  framRing(const framRing& other);
+
+  /**
+   * @brief Stop IoTNode::flush() from committing the ring.
+   * Use commit() first to keep the latest ring pointers.
+   * 
+   */
+  ~framRing();
 
 	/**
 	 * @brief Pop the oldest element off the ring.
@@ -284,7 +460,7 @@ class framRing
   bool popLast(byte *buffer);
 
   /**
-   * @brief Peek (do not remove) the last (newest) element on the ring.
+   * @brief Peek (do not remove) the first (oldest) element on the ring.
    *
    * @param buffer is a pointer to the element - e.g. (uin8_t*)&element
    * @return true is the pop was successful
@@ -306,11 +482,82 @@ class framRing
 	 * @brief Push an element onto the ring. OVERWRITE if full.
 	 * 
    * @param buffer is a pointer to the element - e.g. (uin8_t*)&element
-   * @return true is the push was successful
-   * @return false if the push was not successful
 	 */	
   void push(byte *buffer);
 
+  /**
+   * @brief Push several elements onto the ring. OVERWRITE if full.
+   * The elements are written with at most two sequential fram transfers
+   * (two when the run wraps around the end of the ring) and the ring
+   * pointers are saved once for the whole batch.
+   * If more elements than the ring size are pushed only the newest are kept.
+   *
+   * @param buffer is a pointer to the elements - e.g. (uint8_t*)elements
+   * @param numberOfElements is the number of elements in the buffer
+   * @return uint32_t the number of elements now stored from the buffer
+   */
+  uint32_t pushN(byte *buffer, uint32_t numberOfElements);
+
+  /**
+   * @brief Pop up to numberOfElements of the oldest elements off the ring.
+   * The elements are returned oldest first and the ring pointers
+   * are saved once for the whole batch.
+   *
+   * @param buffer is a pointer to space for numberOfElements elements
+   * @param numberOfElements is the maximum number of elements to pop
+   * @return uint32_t the number of elements popped into the buffer
+   */
+  uint32_t popN(byte *buffer, uint32_t numberOfElements);
+
+  /**
+   * @brief Peek (do not remove) up to numberOfElements of the oldest elements on the ring.
+   *
+   * @param buffer is a pointer to space for numberOfElements elements
+   * @param numberOfElements is the maximum number of elements to peek
+   * @return uint32_t the number of elements copied into the buffer
+   */
+  uint32_t peekN(byte *buffer, uint32_t numberOfElements);
+
+  /**
+   * @brief Peek (do not remove) up to numberOfElements starting at an element.
+   * Use with findTime() to stream a range of elements, i.e.
+   * @code{.cpp}
+   * uint32_t i = ring.findTime(since);
+   * uint32_t n;
+   * while ((n = ring.peekAt(i, (uint8_t*)samples, 10)) > 0)
+   * {
+   *   // send n samples
+   *   i += n;
+   * }
+   * @endcode
+   *
+   * @param index of the first element - 0 is the oldest
+   * @param buffer is a pointer to space for numberOfElements elements
+   * @param numberOfElements is the maximum number of elements to peek
+   * @return uint32_t the number of elements copied into the buffer
+   */
+  uint32_t peekAt(uint32_t index, byte *buffer, uint32_t numberOfElements);
+
+  /**
+   * @brief Set where the unix time is in each element for findTime().
+   * The elements must be pushed in time order.
+   * i.e. ring.setTimestampOffset(offsetof(Sample, unixTime));
+   *
+   * @param offset of the uint32_t unix time from the start of the element
+   */
+  void setTimestampOffset(uint16_t offset);
+
+  /**
+   * @brief Find the oldest element with a time at or after unixTime.
+   * A binary search that reads only the 4 byte times of about log2(count())
+   * elements. setTimestampOffset() must be set first.
+   *
+   * @param unixTime to search for
+   * @return uint32_t the index of the element for peekAt() - 0 is the oldest.
+   * count() if there are no elements at or after unixTime or a read fails.
+   */
+  uint32_t findTime(uint32_t unixTime);
+
   /**
    * @brief Clear the ring array with 0 values and reset the pointers to the beginning
    * 
@@ -333,21 +580,399 @@ class framRing
    */
 	bool isFull();
 
+  /**
+   * @brief The number of elements currently stored on the ring.
+   *
+   * @return uint32_t the number of elements
+   */
+  uint32_t count();
+
   /**
    * @brief Initializes the ring by loading the saved pointers.
-   * Must be run (in setup) before using the ring
+   * Must be run (in setup) before using the ring.
+   * For a ring with a commit interval, also recovers the elements
+   * pushed after the last commit by following their sequence numbers.
+   * Pointers saved by an earlier library or for a different element size
+   * start the ring again empty. If the pointers can not be read the ring
+   * stays unusable, with framBadResponse, until initialize() is run again.
    * 
    */
   void initialize();
+
+  /**
+   * @brief Save the ring pointers now.
+   * Only needed for a ring with a commit interval - 
+   * see IoTNode::makeFramRing. Also run by IoTNode::flush()
+   * and IoTNode::switchOffFor().
+   * 
+   */
+  void commit();
   
+  protected:
+  // Used by framRingT for a ring at a fixed address
+  framRing(IoTNode& node, uint32_t startAddress, uint32_t numberOfElements, uint32_t sizeOfElement, framResult& result);
+
+  // Used by IoTNode::makeFramRing for a named ring in the partition directory
+  framRing(IoTNode& node, const char *name, uint16_t version, uint32_t numberOfElements, byte sizeOfElement,
+    uint16_t commitInterval, framResult& result);
+  bool ready();
+
+  // Ring pointers as stored in fram in front of the elements
+  struct ringPointers
+  {
+    uint32_t head;      // slot of the oldest element
+    uint32_t count;     // number of elements on the ring
+    uint32_t sequence;  // sequence number of the oldest element
+    uint16_t magic;     // FRAM_RING_MAGIC once saved by this library
+    uint16_t slotSize;  // layout of the slots the pointers describe
+  };
+  void setCommitInterval(uint16_t commitInterval);
+  bool isSequenced();
+  void recover();
+  void savePointers();
+  void changedPointers();
+  uint32_t slotAddress(uint32_t slot);
+  bool readSlots(uint32_t slot, uint32_t numberOfElements, byte *buffer);
+  bool writeSlots(uint32_t slot, uint32_t numberOfElements, byte *buffer, uint32_t sequence);
+  bool readRun(uint32_t slot, uint32_t numberOfElements, byte *buffer);
+  bool writeRun(uint32_t slot, uint32_t numberOfElements, byte *buffer, uint32_t sequence);
+
   private:
+  friend class IoTNode;
+  friend class framPackedRing;
   uint32_t _numberOfElements;
-  byte _sizeOfElement;
-  FramI2C& myFram;
+  uint32_t _sizeOfElement;
+  IoTNode& myNode;
   framResult& myResult;
-  Ring_FramArray myRing;
+  uint32_t _startAddress;
+  ringPointers _pointers;
+  // Slots are the element plus a sequence number when sequenced
+  uint32_t _slotSize;
+  uint16_t _commitInterval;
+  uint16_t _uncommitted;
+  framRing *_nextLazy = NULL;
+  bool _registered = false;
+  // Offset of the unix time in each element for findTime()
+  uint16_t _timestampOffset = 0;
+  // Named rings are found in the partition directory on first use
+  const char *_name = NULL;
+  uint16_t _version = 0;
+  bool _located = true;
+  // The pointers could not be read by initialize()
+  bool _unread = false;
 };
 
+/**
+ * @brief Most channels in one framPackedRing record.
+ * 
+ */
+#define FRAM_PACKED_MAX_CHANNELS 8
+
+/**
+ * @brief Largest framPackedRing block, the sizeOfElement of its framRing.
+ * 
+ */
+#define FRAM_PACKED_MAX_BLOCK_SIZE 64
+
+/**
+ * @brief The framPackedRing class packs records of int32_t channels into the
+ * fixed size elements (blocks) of a framRing.
+ *
+ * Each channel is saved as a zigzag varint of the difference from the
+ * previous record, so slow moving values such as a unix time and most
+ * sensor readings take 1 or 2 bytes instead of 4. The first record in each
+ * block is saved in full so a block can be read after older blocks are
+ * overwritten. A block is built in RAM and pushed onto the ring when full.
+ * flush(), which IoTNode::flush() and IoTNode::switchOffFor() also run,
+ * saves a partly filled block that later records, even after a restart,
+ * keep filling. A block stays on the ring until all its records are
+ * popped, i.e.
+ * @code{.cpp}
+ * framRing samplesRing = node.makeFramRing("samples", 400, 32);
+ * framPackedRing samples(samplesRing, 3);
+ * int32_t sample[3] = {(int32_t)node.unixTime(), temperature, humidity};
+ * samples.push(sample);
+ * @endcode
+ */
+class framPackedRing
+{
+  public:
+
+  /**
+   * @brief Construct a new framPackedRing object.
+   *
+   * @param ring holds the blocks - its sizeOfElement is the block size. The
+   * block size must be at least 1 + 5 * channels and at most
+   * FRAM_PACKED_MAX_BLOCK_SIZE
+   * @param channels is the number of int32_t values in each record, at most
+   * FRAM_PACKED_MAX_CHANNELS
+   * @param deltaChannels is a bit mask of the channels saved as differences.
+   * Channels that change a lot between records are smaller saved in full
+   */
+  framPackedRing(framRing& ring, byte channels, uint32_t deltaChannels = 0xFFFFFFFF);
+
+  /**
+   * @brief Copy a framPackedRing. The copy is also flushed by IoTNode::flush().
+   *
+   * @param other is the framPackedRing to copy
+   */
+  framPackedRing(const framPackedRing& other);
+
+  /**
+   * @brief Stop IoTNode::flush() from flushing the ring.
+   * 
+   */
+  ~framPackedRing();
+
+  /**
+   * @brief Add a record.
+   *
+   * @param values is an array of channels int32_t values
+   * @return true if added
+   * @return false if the ring's block size does not fit a record
+   */
+  bool push(const int32_t *values);
+
+  /**
+   * @brief Remove the oldest record.
+   * Records pushed since the last full block are read from RAM. Records
+   * popped since the last flush() return after an unexpected power loss.
+   *
+   * @param values is an array with space for channels int32_t values
+   * @return true if a record was removed
+   * @return false if there are no records
+   */
+  bool pop(int32_t *values);
+
+  /**
+   * @brief Save the partly filled block and the partly popped block to Fram.
+   * The partly filled block is saved as the newest element of the ring and
+   * is rewritten in place by the next flush() as records are added. The
+   * partly popped block is saved with only the records left, unless they
+   * no longer fit once the first is saved in full.
+   * Also run by IoTNode::flush() and IoTNode::switchOffFor().
+   *
+   */
+  void flush();
+
+  /**
+   * @brief Check if there are no records.
+   *
+   * @return true if empty
+   * @return false if not empty
+   */
+  bool isEmpty();
+
+  /**
+   * @brief Remove all records and reset the ring pointers.
+   *
+   */
+  void initialize();
+
+  private:
+  friend class IoTNode;
+  byte encodeRecord(const int32_t *values, const int32_t *previous, byte *buffer);
+  byte decodeRecord(const byte *buffer, byte available, const int32_t *previous, int32_t *values);
+  bool isNewest(uint32_t sequence);
+  bool isOldest(uint32_t sequence);
+  bool saveBlock(bool open);
+  void resume();
+  void saveReadBlock();
+  bool loadBlock();
+  bool finishBlock();
+  framRing& myRing;
+  byte _channels;
+  uint32_t _deltaChannels;
+  uint32_t _blockSize;
+  bool _valid;
+  // Block being built and the last record pushed
+  byte _pushBlock[FRAM_PACKED_MAX_BLOCK_SIZE];
+  byte _pushUsed;
+  int32_t _pushPrevious[FRAM_PACKED_MAX_CHANNELS];
+  // The block being built is on the ring as the element with _pushSequence
+  bool _pushSaved;
+  uint32_t _pushSequence;
+  // The ring has been checked for an open block after a restart
+  bool _resumed;
+  // Block being read and the last record popped
+  byte _popBlock[FRAM_PACKED_MAX_BLOCK_SIZE];
+  byte _popUsed;
+  byte _popRemaining;
+  int32_t _popPrevious[FRAM_PACKED_MAX_CHANNELS];
+  // The block being read is still on the ring as the element with _popSequence
+  bool _popSaved;
+  uint32_t _popSequence;
+  // Records popped since the block was read or saved
+  bool _popTaken;
+  framPackedRing *_nextPacked = NULL;
+};
+
+/**
+ * @brief A snapshot of the IoT Node power state.
+ * Returned by IoTNode::readPowerStatus(). Has no pointers so it may be
+ * pushed directly onto a framRing, i.e.
+ * framRing powerLog = node.makeFramRing(100, sizeof(PowerStatus));
+ * 
+ */
+struct PowerStatus
+{
+  float voltage;        // input voltage after the TPS2113 in volts
+  bool liPoPowered;     // TPS2113 is switched to the LiPo
+  bool threeAAPowered;  // TPS2113 is switched to the 3AA/A battery
+  bool liPoCharged;     // CN3065 DONE
+  bool liPoCharging;    // CN3065 CHRG
+};
+
+/**
+ * @brief The result of IoTNode::readVoltageBurst().
+ * 
+ */
+struct voltageStats
+{
+  uint32_t samples;   // samples read - fewer than asked if the ADC stopped responding
+  uint16_t minimum;   // lowest sample in mV
+  uint16_t mean;      // mean of the samples in mV
+  uint16_t maximum;   // highest sample in mV
+};
+
+/**
+ * @brief Corrections made to the millis() clock by IoTNode::unixTime().
+ * 
+ */
+struct clockStats
+{
+  uint32_t syncs;               // RTC reads since the first
+  int32_t lastCorrectionMillis; // change made at the last resync - positive when millis() was slow
+  int32_t maxCorrectionMillis;  // largest change made by a resync
+  int32_t driftPPM;             // RTC time gained against millis() since the first sync in parts per million
+};
+
+/**
+ * @brief Bytes of MCP79412 SRAM for the scratchpad.
+ * The 64 SRAM bytes hold a 2 byte layout marker and two copies of the
+ * scratchpad, each with a generation byte and a checksum.
+ * @see IoTNode::writeScratchpad()
+ * 
+ */
+#define IOTNODE_SCRATCHPAD_SIZE 28
+
+/**
+ * @brief Default uSD card SPI clock in MHz - limited to the fastest SPI
+ * clock of the platform. @see IoTNode::setSDClock()
+ * 
+ */
+#ifndef IOTNODE_SD_CLOCK_MHZ
+  #define IOTNODE_SD_CLOCK_MHZ 50
+#endif
+
+/**
+ * @brief Default time in ms between MCP79412 reads by IoTNode::unixTime().
+ * 
+ */
+#ifndef IOTNODE_CLOCK_RESYNC_MILLIS
+  #define IOTNODE_CLOCK_RESYNC_MILLIS 600000
+#endif
+
+/**
+ * @brief The size and speed of the last FRAM backup to the uSD card.
+ * 
+ */
+struct sdTransferStats
+{
+  uint32_t bytes;           // bytes copied
+  uint32_t milliseconds;    // total time including card initialization
+  uint32_t bytesPerSecond;  // average throughput
+};
+
+/**
+ * @brief I2C health of one on-board device. @see IoTNode::i2cStats()
+ * Each endTransmission or requestFrom by the library is one transaction.
+ * 
+ */
+struct i2cDeviceStats
+{
+  uint32_t transactions;  // transactions including NACKs
+  uint32_t nacks;         // transactions not acknowledged or short reads
+  uint32_t recoveries;    // bus recoveries run for the device
+  uint32_t minMicros;     // fastest transaction
+  uint32_t averageMicros; // mean transaction time
+  uint32_t maxMicros;     // slowest transaction
+};
+
+/**
+ * @brief Longest time in ms a bus recovery may take.
+ * A device that fails recovery is not recovered again for a time that
+ * doubles with each failure, so a missing or flaky device fails fast.
+ * 
+ */
+#ifndef IOTNODE_I2C_RECOVERY_MILLIS
+  #define IOTNODE_I2C_RECOVERY_MILLIS 20
+#endif
+
+/**
+ * @brief Number of transactions kept in the I2C trace.
+ * The trace is only built when IOTNODE_I2C_TRACE is defined for the whole
+ * build. Set both as compiler flags, not in the sketch.
+ * @see IoTNode::dumpI2CTrace()
+ * 
+ */
+#ifndef IOTNODE_I2C_TRACE_SIZE
+  #define IOTNODE_I2C_TRACE_SIZE 32
+#endif
+
+/**
+ * @brief Number of on-board I2C devices with i2cDeviceStats.
+ * 
+ */
+#define IOTNODE_I2C_DEVICES 5
+
+/**
+ * @brief Size in bytes of the map of FRAM blocks changed since the last backup.
+ * Each bit is one block so the map covers up to 256 blocks.
+ * 
+ */
+#define FRAM_DIRTY_MAP_SIZE 32
+
+/**
+ * @brief Size in bytes of the Fram before begin() detects the parts.
+ * The on-board MB85RC256V by default. framArrayT and framRingT are checked
+ * against it at compile time and framArray and framRing objects created
+ * before begin() must fit below its partition directory. When a larger or
+ * more than one Fram is fitted set the total size as a compiler flag for
+ * the whole build, i.e. -DIOTNODE_FRAM_SIZE=131072. A #define in the sketch
+ * leaves the library with the default size.
+ * 
+ */
+#ifndef IOTNODE_FRAM_SIZE
+#define IOTNODE_FRAM_SIZE 32768
+#endif
+
+/**
+ * @brief Maximum number of Fram parts - at I2C addresses 0x50 to 0x56.
+ * 0x57 is the MCP79412 EEPROM.
+ * 
+ */
+#define IOTNODE_FRAM_CHIPS 7
+
+/**
+ * @brief Size in bytes of the IoT Node system area at the bottom of Fram.
+ * 
+ */
+#define IOTNODE_FRAM_SYSTEM_SIZE 128
+
+/**
+ * @brief Size in bytes of the partition directory at the top of Fram.
+ * @see IoTNode::makeFramArray(const char*, uint32_t, byte, uint16_t)
+ * 
+ */
+#define IOTNODE_FRAM_DIRECTORY_SIZE 512
+
+/**
+ * @brief Longest partition name including the terminating 0.
+ * 
+ */
+#define IOTNODE_FRAM_NAME_SIZE 12
+
 /**
  * @brief Main IoT Node class.
  * Includes functions to manage external power. Read the state of the battery charger.
@@ -374,15 +999,53 @@ class IoTNode
    */
 
   /**
-   * @brief Start the IoT Node.
-   * Sets the state of the internal MCP23018 expander.
-   * Reads the node mac address stored in the MCP79412
-   * real time clock. Starts (Wire) I2C and attempts to reset if needed.
-   * Checks for the MCP23018 expander.
-   * @return true if the MCP23018 responds
-   * @return false if the MCP23018 does not respond
+   * @brief Start the IoT Node.
+   * Sets the state of the internal MCP23018 expander.
+   * Reads the node mac address stored in the MCP79412
+   * real time clock. Starts (Wire) I2C and attempts to reset if needed.
+   * Checks for the MCP23018 expander.
+   *
+   * After a wake by switchOffFor() the MCP79412 alarm flag is set and
+   * begin() takes a warm start: the node ID and the Fram dirty map come
+   * from a boot record saved in Fram by switchOffFor() and the expander
+   * configuration is written without being read. Any failure falls back
+   * to the full (cold) start. @see warmStarted()
+   *
+   * @param warmStart false to always take the cold start
+   * @return true if the MCP23018 responds
+   * @return false if the MCP23018 does not respond
+   */
+  bool begin(bool warmStart = true);
+
+  /**
+   * @brief Check if begin() took the warm start after an RTC alarm wake.
+   * The MCP79412, MCP23018 and Fram all answered during a warm start so
+   * ok() is only needed after a cold start.
+   *
+   * @return true after a warm start
+   * @return false after a cold start
+   */
+  bool warmStarted();
+
+  /**
+   * @brief Get the total size of the Fram.
+   * A cold start reads the device ID of each Fram from 0x50 up and joins the
+   * parts into one address space in I2C address order. A warm start takes
+   * the parts from the boot record. An MB85RC1M takes
+   * two I2C addresses. Before begin(), or when the parts can not be
+   * identified, this is IOTNODE_FRAM_SIZE. The partition directory is at
+   * the top so named partitions move when the size changes.
+   *
+   * @return size in bytes
+   */
+  uint32_t framSize();
+
+  /**
+   * @brief Get the number of Fram parts found by begin().
+   *
+   * @return number of parts
    */
-  bool begin();
+  uint8_t framChips();
 
   /**
    * @brief Checks to see if the IoT Node is working correctly
@@ -453,12 +1116,106 @@ class IoTNode
    */    
   void allPowerOFF();
 
+  /**
+   * @brief Hold changes to the power enable and GPIO outputs.
+   * The expander output state is kept in a shadow register and
+   * setPower, powerON, powerOFF and setGIO only change the shadow
+   * until applyOutputs() is called. Use to switch several rails
+   * with a single I2C write.
+   * 
+   */
+  void holdOutputs();
+
+  /**
+   * @brief Write any changed outputs to the MCP23018 expander.
+   * Both output ports are written in a single I2C transaction.
+   * Releases holdOutputs().
+   * 
+   * @return true if the write was successful or nothing had changed
+   * @return false if the expander did not respond
+   */
+  bool applyOutputs();
+
+  /**
+   * @brief Write the changes in all cached framArrays to Fram
+   * and save the pointers of framRings with a commit interval.
+   * Background requests are finished first.
+   * @see framArray::enableCache
+   * @see framRing::commit
+   * 
+   */
+  void flush();
+
+  /**
+   * @brief Run the next step of the background requests.
+   * Each call uses at most one I2C transfer of up to the Wire buffer size so
+   * loop() can call poll() between other work, i.e.
+   * @code{.cpp}
+   * node.requestWatchdog();
+   * ...
+   * void loop()
+   * {
+   *   node.poll();
+   *   // read sensors, service the radio
+   * }
+   * @endcode
+   * Requests run in the order they are made. poll() is not safe to call from
+   * another thread while the blocking functions are used.
+   *
+   * @return true if requests are still waiting
+   * @return false if there are no requests
+   */
+  bool poll();
+
+  /**
+   * @brief Get the state of a request made without a callback.
+   * A done or failed request is freed by this call.
+   *
+   * @param handle returned by the request function
+   * @return requestStatus REQUEST_PENDING, REQUEST_DONE, REQUEST_FAILED or
+   * REQUEST_NONE for an unknown handle
+   */
+  requestStatus requestState(int handle);
+
+  /**
+   * @brief Pulse the watchdog without blocking. @see tickleWatchdog()
+   * The pulse ends on the first poll() 50ms after it starts. Other requests
+   * run during the pulse.
+   *
+   * @param callback is called when the pulse ends
+   * @param context is passed to the callback
+   * @return int the request handle, -1 if the queue is full
+   */
+  int requestWatchdog(requestCallback callback = NULL, void *context = NULL);
+
+  /**
+   * @brief Write the output shadow to the expander in the background.
+   * Use after holdOutputs() and setPower() or setGIO() changes in place of
+   * applyOutputs().
+   *
+   * @param callback is called when the write is done
+   * @param context is passed to the callback
+   * @return int the request handle, -1 if the queue is full
+   */
+  int requestOutputs(requestCallback callback = NULL, void *context = NULL);
+
+  /**
+   * @brief Read the input voltage in the background. @see voltage()
+   *
+   * @param voltage is set to the voltage - must stay valid until done
+   * @param callback is called when the read is done
+   * @param context is passed to the callback
+   * @return int the request handle, -1 if the queue is full
+   */
+  int requestVoltage(float *voltage, requestCallback callback = NULL, void *context = NULL);
+
   /**
    * @brief Use the internal real time clock to switch off the IoT Node power.
    * The IoT Node "RTC CONTROL" switch must be set to "Yes" for this to work.
    * Note that the sleep times is in seconds.  The internal clock adds the sleep
    * seconds to the current date and time and stores the new wake up
    * date and time in memory.
+   * Cached framArrays and framRings are flushed to Fram first.
    * 
    * NOTE:
    * The mask defines what the clock checks to wake up (switch back on) the
@@ -484,6 +1241,9 @@ class IoTNode
    * seconds to the current date and time and stores the new wake up
    * date and time in memory.
    * 
+   * Cached framArrays and framRings are flushed to Fram first and the
+   * boot record is saved so that begin() takes the warm start on wake.
+   * 
    * @param seconds time in seconds to switch off the power
    */
   void switchOffFor(long seconds);
@@ -589,22 +1349,84 @@ class IoTNode
    */
   bool isLiPoCharging();
 
+  /**
+   * @brief Reads the TPS2113 and CN3065 states and the input voltage in one pass.
+   * All of the status pins are read from the MCP23018 with a single
+   * I2C read, rather than one read per isLiPoPowered(), is3AAPowered(),
+   * isLiPoCharged() and isLiPoCharging() call.
+   * 
+   * @return PowerStatus a snapshot of the power state
+   */
+  PowerStatus readPowerStatus();
+
   /**
    * @brief Measures the IoT Node input voltage.
    * The voltage is measured after the TPS2113 auto switching
    * power multiplexer.
    * 
-   * @return float - the input voltage in volts
+   * @return float - the input voltage in volts, 0.0 if the ADC does not respond
    */
   float voltage();
 
+  /**
+   * @brief Measures the IoT Node input voltage without float math.
+   *
+   * @param millivolts is set to the input voltage in mV
+   * @return true if the ADC responded
+   * @return false if the ADC did not respond - millivolts is not changed
+   */
+  bool readVoltage(uint16_t& millivolts);
+
+  /**
+   * @brief Measures the input voltage numberOfSamples times as fast as the
+   * I2C bus allows, i.e. to see the sag when EXT5V is switched on.
+   * The MCP3221 sends conversions continuously during a read so each
+   * Wire buffer holds many samples.
+   * Each sample is the mean of 2^oversampleBits conversions as a fixed point
+   * ADC code with 4 fractional bits (0 to 65520). Convert a sample with
+   * IoTNode::sampleMillivolts(). 
+   * i.e.
+   * @code{.cpp}
+   * uint16_t sag[100];
+   * node.powerON(EXT5V);
+   * voltageStats stats = node.readVoltageBurst(100, 2, sag);
+   * @endcode
+   *
+   * @param numberOfSamples to read
+   * @param oversampleBits is log2 of the conversions averaged for each sample - 0 to 8
+   * @param samples is space for numberOfSamples samples - NULL for only the stats
+   * @return voltageStats the number of samples read and their min, mean and max
+   */
+  voltageStats readVoltageBurst(uint32_t numberOfSamples, uint8_t oversampleBits = 0, uint16_t *samples = NULL);
+
+  /**
+   * @brief Convert a readVoltageBurst() sample to mV.
+   *
+   * @param sample is a fixed point ADC code with 4 fractional bits
+   * @return uint16_t the voltage in mV
+   */
+  static uint16_t sampleMillivolts(uint16_t sample);
+
   /**
    * @brief Returns the real time clock time in epoch or unix time.
+   * The MCP79412 is read on the first call and then every
+   * setClockResync() interval. In between the time is kept with millis()
+   * so a call does not use I2C. @see unixTimeMillis()
    * 
    * @return uint32_t unix time in seconds
    */
   uint32_t unixTime();
 
+  /**
+   * @brief Returns the unix time in ms for timestamps finer than a second.
+   * The MCP79412 counts whole seconds so the ms are found over
+   * successive resyncs - each resync moves the clock by the least amount
+   * that agrees with the RTC second. The time never goes backwards.
+   * 
+   * @return uint64_t unix time in ms
+   */
+  uint64_t unixTimeMillis();
+
   /**
    * @brief Set the real time clock unix time in seconds
    * 
@@ -612,6 +1434,76 @@ class IoTNode
    */
   void setUnixTime(uint32_t unixtime);
 
+  /**
+   * @brief Set how often unixTime() reads the MCP79412.
+   * 
+   * @param intervalMillis time in ms between RTC reads - 0 to read the RTC
+   * on every call. The default is IOTNODE_CLOCK_RESYNC_MILLIS
+   */
+  void setClockResync(uint32_t intervalMillis);
+
+  /**
+   * @brief Read the MCP79412 now and correct the millis() clock.
+   * 
+   */
+  void syncClock();
+
+  /**
+   * @brief Write to the scratchpad in the battery backed MCP79412 SRAM.
+   * For small, often changed values (i.e. a run count) that should not use
+   * Fram. The whole scratchpad is written over the older of its two SRAM
+   * copies, so a reset during the write leaves the last good copy.
+   * The SRAM keeps its values while the RTC has battery power.
+   * @see scratchpadT for typed values
+   * 
+   * @param offset of the first byte - 0 to IOTNODE_SCRATCHPAD_SIZE - 1
+   * @param data to write
+   * @param numberOfBytes to write
+   * @return true if written
+   * @return false if outside the scratchpad or the RTC did not respond
+   */
+  bool writeScratchpad(uint8_t offset, const void *data, uint8_t numberOfBytes);
+
+  /**
+   * @brief Read from the scratchpad.
+   * Reads the RAM copy loaded by begin() so does not use I2C.
+   * 
+   * @param offset of the first byte
+   * @param data is space for numberOfBytes bytes
+   * @param numberOfBytes to read
+   * @return true if read
+   * @return false if outside the scratchpad
+   */
+  bool readScratchpad(uint8_t offset, void *data, uint8_t numberOfBytes);
+
+  /**
+   * @brief Read all of the MCP79412 SRAM into the scratchpad RAM copy.
+   * Run by begin() - with one I2C read when the Wire buffer holds 64 bytes.
+   * Loads the newest copy with a good checksum. Only SRAM without the layout
+   * marker (i.e. first use, after the RTC battery is removed or SRAM used by
+   * other firmware) is cleared and set up. SRAM with the marker but no good
+   * copy is cleared too.
+   * 
+   * @return true if a good copy was loaded
+   * @return false if the scratchpad was cleared or the RTC did not respond
+   */
+  bool loadScratchpad();
+
+  /**
+   * @brief Set all of the scratchpad to 0.
+   * 
+   * @return true if written
+   * @return false if the RTC did not respond
+   */
+  bool clearScratchpad();
+
+  /**
+   * @brief How far the millis() clock has moved from the MCP79412.
+   * 
+   * @return clockStats the corrections made at the resyncs
+   */
+  clockStats clockDrift();
+
   /**
    * @brief The IoT Node mac address as a string.
    * This is the value of the MCP79412 real time clock.
@@ -623,30 +1515,190 @@ class IoTNode
   String nodeID;
 
   /**
-   * @brief Copies the FRAM memory from byte 129 onwards to a file on the uSD card
+   * @brief Copies the whole FRAM memory to a file on the uSD card.
+   * Any existing file is replaced by a pre-allocated contiguous file
+   * that is written in 512 byte sectors.
+   * The size, time and speed of the backup are saved in lastSDTransfer.
    * 
    * @param filename 
    * @return true 
-   * @return false 
+   * @return false if the card or a FRAM read failed - the changed blocks
+   * stay marked for the next backup
    */
   bool backupFRAMtoSD(String filename);
 
   /**
    * @brief Restores a previous backup of FRAM from a file on the uSD card to FRAM
+   * After a failed restore all blocks are marked as changed for the next backup.
    * 
    * @param filename 
    * @return true 
-   * @return false 
+   * @return false if the file could not be read or FRAM written
    */
   bool restoreFRAMfromSD(String filename);
 
+  /**
+   * @brief Saves a compact snapshot of FRAM to a file on the uSD card.
+   * The snapshot has a header and one record per 64 byte block of data,
+   * each with a CRC. Runs of blocks filled with a single value (e.g. unused
+   * zeroed FRAM) are saved as a single record with no data.
+   * 
+   * @param filename 
+   * @return true 
+   * @return false if the card or a FRAM read failed - the changed blocks
+   * stay marked for the next backup
+   */
+  bool backupFRAMSnapshotToSD(String filename);
+
+  /**
+   * @brief Restores a snapshot saved by backupFRAMSnapshotToSD() to FRAM.
+   * Every record CRC is checked before FRAM is written so a
+   * damaged snapshot leaves FRAM unchanged.
+   * 
+   * @param filename 
+   * @return true if the snapshot was valid and restored
+   * @return false if the snapshot could not be read or is damaged or a
+   * FRAM write failed - then all blocks are marked as changed
+   */
+  bool restoreFRAMSnapshotFromSD(String filename);
+
+  /**
+   * @brief Set the size of the blocks that are tracked for backupFRAMChangesToSD().
+   * Every write to FRAM through a framArray, framRing or the IoT Node marks the
+   * blocks that it touches as changed. Smaller blocks make smaller backups.
+   * Changing the block size marks every block as changed.
+   * 
+   * @param blockSize in bytes - a power of two, at least FRAM size / 256 (128 for the MB85RC256V).
+   * begin() raises it to the smallest size that covers the Fram that it finds.
+   * @return true if the block size was set
+   * @return false if the block size is not valid
+   */
+  bool setBackupBlockSize(uint16_t blockSize);
+
+  /**
+   * @brief Appends the FRAM blocks that have changed since the last backup
+   * to a file on the uSD card.
+   * The blocks are marked as unchanged when the file is written so the
+   * next call only appends newer changes. Start a new changes file
+   * after each full backupFRAMtoSD().
+   * The map of changed blocks is kept in FRAM so it survives switchOffFor().
+   * 
+   * @param filename of the changes file
+   * @return true if the changes were appended (or there were none)
+   * @return false if the uSD card or file could not be written or a FRAM
+   * read failed - the blocks stay marked as changed. A batch cut short by a
+   * FRAM read is removed from the file.
+   */
+  bool backupFRAMChangesToSD(String filename);
+
+  /**
+   * @brief Restores a full backup and then replays the changes appended
+   * by backupFRAMChangesToSD().
+   * A missing changes file restores the full backup only. After a failed
+   * restore all blocks are marked as changed for the next backup.
+   * 
+   * @param filename of the full backup
+   * @param changesFilename of the changes file
+   * @return true 
+   * @return false if a file could not be read or FRAM written
+   */
+  bool restoreFRAMfromSD(String filename, String changesFilename);
+
+  /**
+   * @brief The size, time and speed of the last backupFRAMtoSD(),
+   * backupFRAMChangesToSD() or backupFRAMSnapshotToSD()
+   * 
+   */
+  sdTransferStats lastSDTransfer = {0, 0, 0};
+
+  /**
+   * @brief Set the SPI clock for the uSD card.
+   * The card is mounted by the first backup or restore and stays mounted
+   * so later backups skip the card and volume start up. A new clock is
+   * used from the next mount.
+   * 
+   * @param mhz the SPI clock in MHz - limited to 1 to the fastest SPI clock
+   * of the platform (iotNodeBoard::sdMaxClockMHz). Cards are only sure to
+   * run at up to 25 MHz so use a lower clock if a card does not mount.
+   * The default is IOTNODE_SD_CLOCK_MHZ
+   */
+  void setSDClock(uint8_t mhz);
+
+  /**
+   * @brief Unmount the uSD card.
+   * The card idles between backups with chip select high. Use before
+   * removing the card or switching off its power - the next backup or
+   * restore mounts it again.
+   * 
+   */
+  void endSD();
+
   void resetWire();
 
+  /**
+   * @brief Check that an I2C device answers, recovering the bus if needed.
+   * Recovery clocks the bus free and retries with a doubling wait for at
+   * most IOTNODE_I2C_RECOVERY_MILLIS. After a failed recovery an on-board
+   * device fails at once, without recovery, for a backoff time that doubles
+   * with each failure.
+   *
+   * @param address of the I2C device
+   * @return true if the device answers
+   * @return false if the device does not answer
+   */
+  bool probeI2C(byte address);
+
+  /**
+   * @brief Get the I2C health of an on-board device.
+   * The MCP79412 RTC (0x6F) and EEPROM (0x57), MCP23018 expander (0x20),
+   * MCP3221 ADC (0x4D) and Fram (0x50). Each MCP7941x library call (i.e.
+   * reading the RTC time or setting the alarm) counts as one answered
+   * transaction as the library does not return the Wire result.
+   *
+   * @param address of the device
+   * @return i2cDeviceStats all zeros for other addresses
+   */
+  i2cDeviceStats i2cStats(byte address);
+
+  /**
+   * @brief Reset the I2C health of all on-board devices.
+   *
+   */
+  void clearI2CStats();
+
+#ifdef IOTNODE_I2C_TRACE
+  /**
+   * @brief Print the I2C transactions, bytes and time for each library API
+   * and each on-board device, then the most recent transactions oldest first.
+   * Only built when IOTNODE_I2C_TRACE is a compiler flag for the whole
+   * build, the library as well as the sketch, i.e. a local Device OS build
+   * with make EXTRA_CFLAGS=-DIOTNODE_I2C_TRACE or build_flags =
+   * -DIOTNODE_I2C_TRACE in platformio.ini. A #define in
+   * the sketch is not seen when IoTNode.cpp is compiled - the IoTNode
+   * class would then differ between the two and dumpI2CTrace() would not
+   * link.
+   * Transactions made inside another API call count against the outer call,
+   * i.e. the Fram reads of framRing::pop in poll() count against poll.
+   * Each MCP7941x library call is one C entry with 0 bytes and an unknown
+   * (?) result.
+   *
+   * @param out is where to print, i.e. Serial
+   */
+  void dumpI2CTrace(Print& out);
+
+  /**
+   * @brief Reset the I2C trace and its counters.
+   *
+   */
+  void clearI2CTrace();
+#endif
+
   /**
    * @brief Create a ring array of elements in Fram.
    * The function keeps track of the ring array pointers.
    * IoT Node includes a 256 kbits MB85RC256V I2C Fram
    * Requires initialize() to be run prior to use.
+   * The ring pointers take 16 bytes of Fram in front of the elements.
    * i.e.
    * // Create FRAM ring of 10 integers
    * int values;
@@ -655,14 +1707,21 @@ class IoTNode
    * 
    * @param numberOfElements in the ring array
    * @param sizeOfElement is the size of an element (use sizeof())
+   * @param commitInterval is the number of push and pop operations between
+   * saves of the ring pointers - 1 saves on every operation. Above 1 each
+   * element uses 4 more bytes of Fram for a sequence number. See framRing.
    * @return framRing a ring object in on-board fram
    */
-  framRing makeFramRing(uint32_t numberOfElements, byte sizeOfElement);
+  framRing makeFramRing(uint32_t numberOfElements, byte sizeOfElement, uint16_t commitInterval = 1);
 
   /**
    * @brief Create an array of elements in Fram.
    * The function keeps track of the ring array pointers.
    * IoT Node includes a 256 kbits MB85RC256V I2C Fram
+   * Arrays and rings are placed in the order they are created after the
+   * IOTNODE_FRAM_SYSTEM_SIZE bytes of the IoT Node system area. The array
+   * has no layout marker so data saved at other addresses (i.e. by the
+   * FramI2C-based library) is read without an error - see the README.
    * i.e.
    * struct Status
    * {
@@ -679,6 +1738,65 @@ class IoTNode
    */
   framArray makeFramArray(uint32_t numberOfElements, byte sizeOfElement);
 
+  /**
+   * @brief Create a named ring array of elements in Fram.
+   * The location is saved in a partition directory at the top of Fram so
+   * the ring keeps its place and its data when other framRings or
+   * framArrays are added or removed in a firmware update.
+   * New names are added below the existing ones without moving them.
+   * If the number of elements, the element size or the version change
+   * the ring starts empty in its old space when the new size fits,
+   * otherwise in new space. See clearPartitions() to give back space left behind.
+   * The directory is read when the ring is initialized - i.e. after begin().
+   * i.e.
+   * framRing samples = node.makeFramRing("samples", 100, sizeof(sample));
+   * 
+   * @param name of up to 11 characters - must remain valid (e.g. a string literal)
+   * @param numberOfElements in the ring array
+   * @param sizeOfElement is the size of an element (use sizeof())
+   * @param version change to give the ring new space when the element layout changes
+   * @param commitInterval is the number of push and pop operations between
+   * saves of the ring pointers. See makeFramRing(uint32_t, byte, uint16_t).
+   * @return framRing a ring object in on-board fram
+   */
+  framRing makeFramRing(const char *name, uint32_t numberOfElements, byte sizeOfElement, uint16_t version = 0,
+    uint16_t commitInterval = 1);
+
+  /**
+   * @brief Create a named array of elements in Fram.
+   * The location is saved in a partition directory at the top of Fram so
+   * the array keeps its place and its data when other framRings or
+   * framArrays are added or removed in a firmware update.
+   * New names are added below the existing ones without moving them.
+   * If the number of elements, the element size or the version change
+   * the array keeps its old space when the new size fits, otherwise it is
+   * given new space. See clearPartitions() to give back space left behind.
+   * Unnamed arrays and rings that reach a named one fail with
+   * framBadFinishAddress rather than overlap it.
+   * The directory is read on the first read or write - i.e. after begin().
+   * i.e.
+   * framArray status = node.makeFramArray("status", 1, sizeof(testStatus));
+   * 
+   * @param name of up to 11 characters - must remain valid (e.g. a string literal)
+   * @param numberOfElements in the array
+   * @param sizeOfElement is the size of an element (use sizeof())
+   * @param version change to give the array new space when the element layout changes
+   * @return framArray an array object in on-board fram
+   */
+  framArray makeFramArray(const char *name, uint32_t numberOfElements, byte sizeOfElement, uint16_t version = 0);
+
+  /**
+   * @brief Forget all named framArrays and framRings.
+   * Compacts the partitions after an update has grown some of them: each
+   * name is given new space from the top of Fram when it is next used, and
+   * all named arrays and rings start again empty.
+   * Call after begin() and before any named array or ring is used.
+   * 
+   * @return true if the directory was cleared
+   * @return false if the Fram did not respond
+   */
+  bool clearPartitions();
+
   /**
    * @brief Returns framResult enum.
    * 
@@ -700,10 +1818,567 @@ class IoTNode
   framResult myResult = framUnknownError; 
 
   private:
+  friend class framArray;
+  friend class framRing;
+  friend class framPackedRing;
+  template <typename T, uint32_t N, uint32_t Address> friend class framArrayT;
+  template <typename T, uint32_t N, uint32_t Address> friend class framRingT;
   void array_to_string(byte array[], unsigned int len, char buffer[]);
-  FramI2C myFram;
-  void writeFRAM(uint32_t startaddress, uint8_t numberOfBytes, uint8_t *buffer);
-  void readFRAM(uint32_t startaddress, uint8_t numberOfBytes, uint8_t *buffer);
+  // Fram parts in address space order
+  struct framChip
+  {
+    byte address;
+    uint32_t size;
+  };
+  framChip _framChips[IOTNODE_FRAM_CHIPS];
+  uint8_t _framChipCount;
+  uint32_t _framSize;
+  void detectFRAM();
+  void useFRAM(const framChip *chips, uint8_t count);
+  uint32_t framPartSize(byte address);
+  uint32_t framSegment(uint32_t address, uint32_t numberOfBytes, byte& device, uint16_t& offset);
+  // Next free fram address handed out to framArray and framRing
+  uint32_t _framNextAddress;
+  // Lowest named partition - read by begin() and kept by findPartition()
+  uint32_t _partitionsAddress;
+  // framArrays with a RAM cache that flush() writes back
+  framArray *_cachedArrays = NULL;
+  // framRings with a commit interval that flush() commits
+  framRing *_lazyRings = NULL;
+  // framPackedRings that flush() saves
+  framPackedRing *_packedRings = NULL;
+  uint32_t allocateFRAM(uint32_t numberOfBytes, framResult& result);
+  bool writeFRAM(uint32_t startaddress, uint32_t numberOfBytes, uint8_t *buffer);
+  bool readFRAM(uint32_t startaddress, uint32_t numberOfBytes, uint8_t *buffer);
+  // Partition directory at the top of fram
+  struct framDirectoryHeader
+  {
+    uint32_t magic;
+    uint16_t numberOfEntries;
+    uint16_t reserved;
+    uint32_t lowestAddress;   // start of the lowest partition
+    uint32_t reserved2;
+  };
+  struct framDirectoryEntry
+  {
+    char name[IOTNODE_FRAM_NAME_SIZE];
+    uint32_t address;
+    uint32_t numberOfElements;
+    uint32_t sizeOfElement;
+    uint16_t version;
+    uint16_t type;
+    uint32_t numberOfBytes;   // space reserved for the partition
+  };
+  uint32_t directoryAddress();
+  bool readDirectoryHeader(framDirectoryHeader& header);
+  bool findPartition(const char *name, uint16_t type, uint32_t numberOfElements, uint32_t sizeOfElement,
+    uint16_t version, uint32_t numberOfBytes, uint32_t& address, bool& created);
+  bool writeFRAMUntracked(uint32_t startaddress, uint32_t numberOfBytes, uint8_t *buffer);
+  // Blocks changed since the last backup
+  struct framChangesHeader
+  {
+    uint32_t magic;
+    uint16_t blockSize;
+    uint16_t numberOfBlocks;
+  };
+  uint32_t _systemAddress;
+  uint16_t _backupBlockSize = 128;
+  byte _dirtyMap[FRAM_DIRTY_MAP_SIZE];
+  void markDirty(uint32_t startaddress, uint32_t numberOfBytes);
+  // Saved in the system area by switchOffFor() for a warm start
+  struct framBootRecord
+  {
+    uint32_t magic;
+    byte eui64[8];
+    byte framAddresses[IOTNODE_FRAM_CHIPS];
+    byte framSizeBits[IOTNODE_FRAM_CHIPS]; // log2 of the part size, 0 after the last part
+    uint16_t expanderHash;
+    uint16_t crc;
+  };
+  byte _eui64[8] = {0};
+  bool _warmStarted = false;
+  bool coldBegin();
+  bool warmBegin();
+  void writeBootRecord();
+  void switchOff(long seconds, maskValue mask, bool stopClock);
+  uint16_t expanderHash();
+  // CRC-16/CCITT for the boot record, scratchpad and snapshots - pass 0xFFFF or the CRC so far
+  uint16_t crc16(const uint8_t *data, uint32_t numberOfBytes, uint16_t crc);
+  bool readRTC(byte reg, byte *data, uint8_t numberOfBytes);
+  bool readADC(uint16_t& code);
+  // uSD card mounted by the first backup or restore
+  bool _sdMounted = false;
+  uint8_t _sdClockMHz = IOTNODE_SD_CLOCK_MHZ < iotNodeBoard::sdMaxClockMHz ? IOTNODE_SD_CLOCK_MHZ :
+    iotNodeBoard::sdMaxClockMHz;
+  bool mountSD();
+  bool writeRTC(byte reg, const byte *data, uint8_t numberOfBytes);
+  // RAM copy of the scratchpad and the SRAM copy it was loaded from or last written to
+  byte _scratchpad[IOTNODE_SCRATCHPAD_SIZE] = {0};
+  uint8_t _scratchpadCopy = 0;
+  uint8_t _scratchpadGeneration = 0;
+  bool saveScratchpad();
+  // millis() clock disciplined by the MCP79412
+  bool _clockValid = false;
+  uint64_t _clockBase = 0;         // unix ms at _clockBaseMillis
+  uint32_t _clockBaseMillis = 0;
+  uint64_t _clockFirst = 0;        // unix ms at the first sync - for the drift
+  uint32_t _clockFirstMillis = 0;
+  uint64_t _clockLast = 0;         // last time returned - keeps time from going backwards
+  uint32_t _clockResyncMillis = IOTNODE_CLOCK_RESYNC_MILLIS;
+  clockStats _clockStats = {0, 0, 0, 0};
+  uint64_t clockNow(uint32_t now);
+  // I2C health of the on-board devices
+  struct i2cDeviceHealth
+  {
+    uint32_t transactions;
+    uint32_t nacks;
+    uint32_t recoveries;
+    uint32_t minMicros;
+    uint32_t maxMicros;
+    uint32_t totalMicros;
+    uint32_t backoffMillis;   // 0 when the device is healthy
+    uint32_t failedMillis;    // time of the last failed recovery
+  };
+  i2cDeviceHealth _i2cHealth[IOTNODE_I2C_DEVICES] = {};
+  int i2cDevice(byte address);
+  void recordI2C(byte address, uint32_t duration, bool ack);
+  void recordCall(byte address, uint32_t start);
+  uint8_t endTransmission(byte address, uint8_t numberOfBytes, bool sendStop = true);
+  bool requestFrom(byte address, uint8_t numberOfBytes);
+  void clearBus();
+#ifdef IOTNODE_I2C_TRACE
+  // I2C trace built with IOTNODE_I2C_TRACE
+  enum traceApi {TRACE_OTHER, TRACE_BEGIN, TRACE_OK, TRACE_OUTPUTS, TRACE_INPUTS, TRACE_WATCHDOG,
+    TRACE_VOLTAGE, TRACE_FRAM_ARRAY, TRACE_FRAM_RING, TRACE_BACKUP, TRACE_POLL, TRACE_FLUSH,
+    TRACE_SLEEP, TRACE_API_COUNT};
+  struct traceCounters
+  {
+    uint32_t transactions;
+    uint32_t bytes;
+    uint32_t micros;
+  };
+  struct i2cTraceRecord
+  {
+    uint32_t startMicros;
+    uint16_t durationMicros;
+    byte address;
+    byte api;
+    uint8_t bytes;
+    uint8_t flags;
+  };
+  // Sets the API for the transactions until the end of the enclosing scope
+  class traceScope
+  {
+    public:
+    traceScope(IoTNode& node, traceApi api);
+    ~traceScope();
+    private:
+    IoTNode& myNode;
+    traceApi _api;
+  };
+  traceApi _traceApi = TRACE_OTHER;
+  traceCounters _traceApis[TRACE_API_COUNT] = {};
+  traceCounters _traceDevices[IOTNODE_I2C_DEVICES] = {};
+  i2cTraceRecord _trace[IOTNODE_I2C_TRACE_SIZE];
+  uint16_t _traceNext = 0;
+  uint16_t _traceCount = 0;
+  void traceI2C(uint32_t start, byte address, uint8_t flags, uint8_t numberOfBytes);
+#endif
+
+  // Background requests run by poll()
+  enum requestType {REQUEST_FRAM_WRITE, REQUEST_FRAM_READ, REQUEST_OUTPUTS, REQUEST_VOLTAGE, REQUEST_WATCHDOG};
+  struct nodeRequest
+  {
+    requestStatus status;
+    requestType type;
+    uint32_t order;       // requests run in this order
+    uint32_t address;     // Fram address of the next transfer
+    uint32_t remaining;   // bytes left to transfer
+    uint8_t *buffer;      // next byte to transfer or the result
+    uint32_t startMillis; // watchdog pulse start
+    bool started;
+    requestCallback callback;
+    void *context;
+  };
+  nodeRequest _requests[IOTNODE_REQUEST_QUEUE_SIZE] = {};
+  uint32_t _requestOrder = 0;
+  int addRequest(requestType type, uint32_t address, uint32_t numberOfBytes, uint8_t *buffer,
+    requestCallback callback, void *context);
+  bool runRequest(nodeRequest& request);
+  void finishRequest(int handle, bool ok);
+  // backupFRAMSnapshotToSD() file header and block records
+  struct framSnapshotHeader
+  {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t blockSize;
+    uint32_t framSize;
+    uint32_t numberOfRecords;
+    uint16_t crc;
+    uint16_t reserved;
+  };
+  struct framSnapshotRecord
+  {
+    uint8_t type;
+    uint8_t fill;
+    uint16_t numberOfBlocks;
+    uint16_t crc;
+  };
+  bool writeSnapshotRecord(framSnapshotRecord& record, const uint8_t *block);
+  bool readSnapshotRecord(framSnapshotRecord& record, uint8_t *block);
+  void loadDirtyMap();
+  void clearDirtyMap(bool dirty);
+  // MCP23018 shadow registers - bit n is expander pin n
+  uint16_t _iodir = 0xFFFF;
+  uint16_t _gppu = 0x0000;
+  uint16_t _olat = 0x0000;
+  // OLAT as last written to the expander
+  uint16_t _olatWritten = 0x0000;
+  bool _holdOutputs = false;
+  bool _outputsChanged = false;
+  void setOutput(uint8_t pin, bool state);
+  void setDirection(uint8_t pin, uint8_t mode);
+  bool writeExpander(byte regA, uint16_t value);
+  bool writeOutputs(uint16_t olat);
+  bool readExpander(byte regA, uint16_t& value);
+  bool writeExpander(byte reg, const byte *data, uint8_t numberOfBytes);
+  bool readExpander(byte reg, byte *data, uint8_t numberOfBytes);
+};
+
+/**
+ * @brief A typed array of N elements of T at a fixed Fram address.
+ * The size and address are checked at compile time and elements may be
+ * larger than 255 bytes. The address must be clear of the system area,
+ * the partition directory and of the Fram used by makeFramArray and
+ * makeFramRing. Use nextAddress to place the next container directly
+ * after this one, i.e.
+ * @code{.cpp}
+ * framArrayT<Status, 1, 0x4000> statusArray(node);
+ * framRingT<int, 10, decltype(statusArray)::nextAddress> valueRing(node);
+ * statusArray.write(0, testStatus);
+ * @endcode
+ * 
+ * @tparam T the element type
+ * @tparam N the number of elements
+ * @tparam Address the Fram address of the first element
+ */
+template <typename T, uint32_t N, uint32_t Address>
+class framArrayT : private framArray
+{
+  public:
+  static constexpr uint32_t address = Address;
+  static constexpr uint32_t size = N * sizeof(T);
+  static constexpr uint32_t nextAddress = Address + size;
+  static_assert(N > 0, "framArrayT needs at least one element");
+  static_assert(Address >= IOTNODE_FRAM_SYSTEM_SIZE, "framArrayT overlaps the IoT Node system area");
+  static_assert(nextAddress <= IOTNODE_FRAM_SIZE - IOTNODE_FRAM_DIRECTORY_SIZE, "framArrayT does not fit in Fram");
+
+  framArrayT(IoTNode& node) : framArray(node, Address, N, sizeof(T), node.myResult)
+  {
+  }
+
+  bool write(uint32_t index, const T& element)
+  {
+    return framArray::write(index, (byte*)&element);
+  }
+
+  bool read(uint32_t index, T& element)
+  {
+    return framArray::read(index, (byte*)&element);
+  }
+
+  void enableCache(T *cache, uint16_t flushEveryWrites = 0, uint32_t flushEveryMillis = 0)
+  {
+    framArray::enableCache((byte*)cache, flushEveryWrites, flushEveryMillis);
+  }
+
+  using framArray::flush;
+};
+
+/**
+ * @brief A typed ring of N elements of T at a fixed Fram address.
+ * Uses the same layout as framRing - the ring pointers are saved in
+ * front of the elements. @see framArrayT for placing typed containers.
+ * 
+ * @tparam T the element type
+ * @tparam N the number of elements
+ * @tparam Address the Fram address of the ring pointers
+ */
+template <typename T, uint32_t N, uint32_t Address>
+class framRingT : private framRing
+{
+  public:
+  static constexpr uint32_t address = Address;
+  static constexpr uint32_t size = sizeof(framRing::ringPointers) + N * sizeof(T);
+  static constexpr uint32_t nextAddress = Address + size;
+  static_assert(N > 0, "framRingT needs at least one element");
+  static_assert(Address >= IOTNODE_FRAM_SYSTEM_SIZE, "framRingT overlaps the IoT Node system area");
+  static_assert(nextAddress <= IOTNODE_FRAM_SIZE - IOTNODE_FRAM_DIRECTORY_SIZE, "framRingT does not fit in Fram");
+
+  framRingT(IoTNode& node) : framRing(node, Address, N, sizeof(T), node.myResult)
+  {
+  }
+
+  void push(const T& element)
+  {
+    framRing::push((byte*)&element);
+  }
+
+  uint32_t pushN(const T *elements, uint32_t numberOfElements)
+  {
+    return framRing::pushN((byte*)elements, numberOfElements);
+  }
+
+  bool pop(T& element)
+  {
+    return framRing::pop((byte*)&element);
+  }
+
+  uint32_t popN(T *elements, uint32_t numberOfElements)
+  {
+    return framRing::popN((byte*)elements, numberOfElements);
+  }
+
+  bool popLast(T& element)
+  {
+    return framRing::popLast((byte*)&element);
+  }
+
+  bool peekFirst(T& element)
+  {
+    return framRing::peekFirst((byte*)&element);
+  }
+
+  bool peekLast(T& element)
+  {
+    return framRing::peekLast((byte*)&element);
+  }
+
+  uint32_t peekN(T *elements, uint32_t numberOfElements)
+  {
+    return framRing::peekN((byte*)elements, numberOfElements);
+  }
+
+  uint32_t peekAt(uint32_t index, T *elements, uint32_t numberOfElements)
+  {
+    return framRing::peekAt(index, (byte*)elements, numberOfElements);
+  }
+
+  using framRing::setTimestampOffset;
+  using framRing::findTime;
+
+  using framRing::clearArray;
+  using framRing::isEmpty;
+  using framRing::isFull;
+  using framRing::count;
+  using framRing::initialize;
+};
+
+/**
+ * @brief A RAM queue of N elements of T to stage elements from interrupt
+ * handlers for a Fram ring.
+ * One producer (i.e. an interrupt handler) may push while one consumer
+ * (i.e. loop() or a thread) drains, without disabling interrupts. push()
+ * takes constant time and never blocks, so it is safe in an interrupt
+ * handler where framRing::push is not. Elements pushed while the queue is
+ * full are dropped and counted by overflows().
+ * @code{.cpp}
+ * stageQueueT<Event, 32> events;
+ * void onPulse() { Event e = {micros()}; events.push(e); }
+ * void loop() { events.drain(eventRing); }
+ * @endcode
+ *
+ * @tparam T the element type - the ring's sizeOfElement must be sizeof(T)
+ * @tparam N the number of elements - a power of 2
+ */
+template <typename T, uint32_t N>
+class stageQueueT
+{
+  public:
+  static_assert(N > 0 && (N & (N - 1)) == 0, "stageQueueT needs a power of 2 elements");
+
+  /**
+   * @brief Add an element. Safe to call from an interrupt handler.
+   *
+   * @param element to add
+   * @return true if added
+   * @return false if the queue is full
+   */
+  bool push(const T& element)
+  {
+    uint32_t head = _head;
+    if (head - _tail >= N)
+    {
+      _overflows = _overflows + 1;
+      return false;
+    }
+    _elements[head & (N - 1)] = element;
+    // The element must be written before the consumer sees the new head
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    _head = head + 1;
+    return true;
+  }
+
+  /**
+   * @brief Remove the oldest element.
+   *
+   * @param element is set to the oldest element
+   * @return true if an element was removed
+   * @return false if the queue is empty
+   */
+  bool pop(T& element)
+  {
+    uint32_t tail = _tail;
+    if (_head == tail)
+    {
+      return false;
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    element = _elements[tail & (N - 1)];
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    _tail = tail + 1;
+    return true;
+  }
+
+  /**
+   * @brief Move up to maxElements elements to a Fram ring with framRing::pushN.
+   * Uses one or two Fram writes as the RAM elements are written in place.
+   *
+   * @param ring with a sizeOfElement of sizeof(T)
+   * @param maxElements is the most elements to move
+   * @return uint32_t the number of elements moved
+   */
+  uint32_t drain(framRing& ring, uint32_t maxElements = N)
+  {
+    uint32_t moved = 0;
+    uint32_t n;
+    while (moved < maxElements && (n = waiting(maxElements - moved)) > 0)
+    {
+      ring.pushN((byte*)&_elements[_tail & (N - 1)], n);
+      release(n);
+      moved += n;
+    }
+    return moved;
+  }
+
+  /**
+   * @brief Move up to maxElements elements to a typed Fram ring.
+   * @see drain(framRing&, uint32_t)
+   */
+  template <uint32_t RN, uint32_t Address>
+  uint32_t drain(framRingT<T, RN, Address>& ring, uint32_t maxElements = N)
+  {
+    uint32_t moved = 0;
+    uint32_t n;
+    while (moved < maxElements && (n = waiting(maxElements - moved)) > 0)
+    {
+      ring.pushN(&_elements[_tail & (N - 1)], n);
+      release(n);
+      moved += n;
+    }
+    return moved;
+  }
+
+  /**
+   * @brief The number of elements waiting in the queue.
+   *
+   * @return uint32_t elements
+   */
+  uint32_t count()
+  {
+    return _head - _tail;
+  }
+
+  /**
+   * @brief The number of elements dropped because the queue was full.
+   * Use to size N.
+   *
+   * @return uint32_t elements dropped since clearOverflows()
+   */
+  uint32_t overflows()
+  {
+    return _overflows;
+  }
+
+  /**
+   * @brief Reset the overflow count.
+   *
+   */
+  void clearOverflows()
+  {
+    _overflows = 0;
+  }
+
+  private:
+  // The number of elements up to maxElements that are in one run to the end of the buffer
+  uint32_t waiting(uint32_t maxElements)
+  {
+    uint32_t tail = _tail;
+    uint32_t n = _head - tail;
+    uint32_t run = N - (tail & (N - 1));
+    if (n > run)
+    {
+      n = run;
+    }
+    if (n > maxElements)
+    {
+      n = maxElements;
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return n;
+  }
+
+  void release(uint32_t n)
+  {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    _tail = _tail + n;
+  }
+
+  T _elements[N];
+  // Free running indexes - the producer only writes _head, the consumer only writes _tail
+  volatile uint32_t _head = 0;
+  volatile uint32_t _tail = 0;
+  volatile uint32_t _overflows = 0;
+};
+
+/**
+ * @brief A typed value at a fixed offset in the MCP79412 SRAM scratchpad.
+ * Place values one after the other with nextOffset, i.e.
+ * @code{.cpp}
+ * scratchpadT<uint32_t, 0> runCount(node);
+ * scratchpadT<uint16_t, decltype(runCount)::nextOffset> lastSample(node);
+ * uint32_t runs = 0;
+ * runCount.read(runs);
+ * runCount.write(runs + 1);
+ * @endcode
+ * 
+ * @tparam T the value type
+ * @tparam Offset the scratchpad offset of the value
+ */
+template <typename T, uint8_t Offset>
+class scratchpadT
+{
+  public:
+  static constexpr uint8_t offset = Offset;
+  static constexpr uint8_t nextOffset = Offset + sizeof(T);
+  static_assert(Offset + sizeof(T) <= IOTNODE_SCRATCHPAD_SIZE, "scratchpadT does not fit in the scratchpad");
+
+  scratchpadT(IoTNode& node) : myNode(node)
+  {
+  }
+
+  bool write(const T& value)
+  {
+    return myNode.writeScratchpad(Offset, &value, sizeof(T));
+  }
+
+  bool read(T& value)
+  {
+    return myNode.readScratchpad(Offset, &value, sizeof(T));
+  }
+
+  private:
+  IoTNode& myNode;
 };
 
 #endif